@@ -0,0 +1,396 @@
+/* LzmaDec.cpp -- LZMA Reference Decoder
+2015-06-14 : Igor Pavlov : Public domain */
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+#include "LzmaDec.hpp"
+
+bool CRangeDecoder::Init()
+{
+  Corrupted = false;
+  Range = 0xFFFFFFFF;
+  Code = 0;
+  Perplexity = 0.f;
+  NumNormalizations = 0;
+
+  Byte b = InStream->ReadByte();
+  
+  for (int i = 0; i < 4; i++)
+    Code = (Code << 8) | InStream->ReadByte();
+  
+  if (b != 0 || Code == Range)
+    Corrupted = true;
+  return b == 0;
+}
+
+#define kTopValue ((UInt32)1 << 24)
+
+void CRangeDecoder::Normalize()
+{
+  if (Range < kTopValue)
+  {
+    Range <<= 8;
+    Code = (Code << 8) | InStream->ReadByte();
+    NumNormalizations++;
+  }
+}
+
+UInt32 CRangeDecoder::DecodeDirectBits(unsigned numBits)
+{
+  Perplexity += numBits;
+  UInt32 res = 0;
+  do
+  {
+    Range >>= 1;
+    Code -= Range;
+    UInt32 t = 0 - ((UInt32)Code >> 31);
+    Code += Range & t;
+    
+    if (Code == Range)
+      Corrupted = true;
+    
+    Normalize();
+    res <<= 1;
+    res += t + 1;
+  }
+  while (--numBits);
+  return res;
+}
+
+unsigned CRangeDecoder::DecodeBit(CProb *prob)
+{
+  unsigned v = *prob;
+  UInt32 bound = (Range >> kNumBitModelTotalBits) * v;
+  unsigned symbol;
+  if (Code < bound)
+  {
+    Perplexity += -log2(v/2048.f);
+    v += ((1 << kNumBitModelTotalBits) - v) >> kNumMoveBits;
+    Range = bound;
+    symbol = 0;
+  }
+  else
+  {
+    Perplexity += -log2(1.f-v/2048.f);
+    v -= v >> kNumMoveBits;
+    Code -= bound;
+    Range -= bound;
+    symbol = 1;
+  }
+  *prob = (CProb)v;
+  Normalize();
+  return symbol;
+}
+
+
+unsigned BitTreeReverseDecode(CProb *probs, unsigned numBits, CRangeDecoder *rc)
+{
+  unsigned m = 1;
+  unsigned symbol = 0;
+  for (unsigned i = 0; i < numBits; i++)
+  {
+    unsigned bit = rc->DecodeBit(&probs[m]);
+    m <<= 1;
+    m += bit;
+    symbol |= (bit << i);
+  }
+  return symbol;
+}
+
+unsigned UpdateState_Literal(unsigned state)
+{
+  if (state < 4) return 0;
+  else if (state < 10) return state - 3;
+  else return state - 6;
+}
+unsigned UpdateState_Match   (unsigned state) { return state < 7 ? 7 : 10; }
+unsigned UpdateState_Rep     (unsigned state) { return state < 7 ? 8 : 11; }
+unsigned UpdateState_ShortRep(unsigned state) { return state < 7 ? 9 : 11; }
+
+// Copies a trivially copyable member to or from a snapshot.
+template <class T>
+static void CopyState(T &dest, const T &src)
+{
+  memcpy(&dest, &src, sizeof(T));
+}
+
+void CLzmaDecoder::TakeSnapshot(unsigned state, UInt32 rep0, UInt32 rep1, UInt32 rep2, UInt32 rep3, UInt64 unpackSize)
+{
+  UInt32 numLitStates = (UInt32)1 << (lc + lp);
+  size_t numAllocated = 0;
+  for (UInt32 i = 0; i < numLitStates; i++)
+    numAllocated += LitProbs[i] != NULL;
+  Budget->Reserve(CLzmaSnapshot::Memory(numAllocated));
+
+  Snapshots.push_back(CLzmaSnapshot());
+  CLzmaSnapshot &s = Snapshots.back();
+  s.InPos = RangeDec.InStream->Processed;
+  s.OutPos = Perplexities.size();
+  s.TotalCost = TotalCost;
+  s.RangeDec = RangeDec;
+  s.State = state;
+  s.Reps[0] = rep0;
+  s.Reps[1] = rep1;
+  s.Reps[2] = rep2;
+  s.Reps[3] = rep3;
+  s.UnpackSize = unpackSize;
+  s.NumLiterals = NumLiterals;
+  s.NumMatches = NumMatches;
+  s.NumReps = NumReps;
+  s.NumShortReps = NumShortReps;
+
+  CopyState(s.PosSlotDecoder, PosSlotDecoder);
+  CopyState(s.AlignDecoder, AlignDecoder);
+  CopyState(s.PosDecoders, PosDecoders);
+  CopyState(s.IsMatch, IsMatch);
+  CopyState(s.IsRep, IsRep);
+  CopyState(s.IsRepG0, IsRepG0);
+  CopyState(s.IsRepG1, IsRepG1);
+  CopyState(s.IsRepG2, IsRepG2);
+  CopyState(s.IsRep0Long, IsRep0Long);
+  CopyState(s.LenDecoder, LenDecoder);
+  CopyState(s.RepLenDecoder, RepLenDecoder);
+
+  s.LitStates.reserve(numAllocated);
+  s.LitProbs.reserve(numAllocated * kNumLitProbs);
+  for (UInt32 i = 0; i < numLitStates; i++)
+    if (LitProbs[i])
+    {
+      s.LitStates.push_back(i);
+      s.LitProbs.insert(s.LitProbs.end(), LitProbs[i], LitProbs[i] + kNumLitProbs);
+    }
+}
+
+void CLzmaDecoder::RestoreSnapshot(const CLzmaSnapshot &s)
+{
+  CInputStream *inStream = RangeDec.InStream;
+  if (!inStream->Buf)
+    throw "Can't resume decoding from a file";
+  if (OutWindow.OutStream.Baseline || LitStats)
+    throw "Can't resume decoding while collecting statistics";
+  RangeDec = s.RangeDec;
+  RangeDec.InStream = inStream;
+  inStream->Processed = s.InPos;
+
+  OutWindow.Rewind(s.OutPos);
+  Perplexities.resize(s.OutPos);
+  Literals.resize(s.OutPos);
+  TotalCost = s.TotalCost;
+  NumLiterals = s.NumLiterals;
+  NumMatches = s.NumMatches;
+  NumReps = s.NumReps;
+  NumShortReps = s.NumShortReps;
+
+  CopyState(PosSlotDecoder, s.PosSlotDecoder);
+  CopyState(AlignDecoder, s.AlignDecoder);
+  CopyState(PosDecoders, s.PosDecoders);
+  CopyState(IsMatch, s.IsMatch);
+  CopyState(IsRep, s.IsRep);
+  CopyState(IsRepG0, s.IsRepG0);
+  CopyState(IsRepG1, s.IsRepG1);
+  CopyState(IsRepG2, s.IsRepG2);
+  CopyState(IsRep0Long, s.IsRep0Long);
+  CopyState(LenDecoder, s.LenDecoder);
+  CopyState(RepLenDecoder, s.RepLenDecoder);
+
+  // Tables allocated after the snapshot go back to their initial state.
+  InitLiterals();
+  for (size_t i = 0; i < s.LitStates.size(); i++)
+    memcpy(GetLitProbs(s.LitStates[i]), &s.LitProbs[i * kNumLitProbs], kNumLitProbs * sizeof(CProb));
+}
+
+void CLzmaDecoder::DropSnapshots(size_t from)
+{
+  for (size_t i = from; i < Snapshots.size(); i++)
+    Budget->Release(CLzmaSnapshot::Memory(Snapshots[i].LitStates.size()));
+  Snapshots.erase(Snapshots.begin() + from, Snapshots.end());
+}
+
+int CLzmaDecoder::Decode(bool unpackSizeDefined, UInt64 unpackSize, int fromSnapshot)
+{
+  UInt32 rep0 = 0, rep1 = 0, rep2 = 0, rep3 = 0;
+  unsigned state = 0;
+  UInt64 nextSnapshot = 0;
+
+  if (fromSnapshot < 0)
+  {
+    DropSnapshots(0);
+    if (!RangeDec.Init())
+      return LZMA_RES_ERROR;
+    Init();
+  }
+  else
+  {
+    const CLzmaSnapshot &s = Snapshots[fromSnapshot];
+    RestoreSnapshot(s);
+    rep0 = s.Reps[0];
+    rep1 = s.Reps[1];
+    rep2 = s.Reps[2];
+    rep3 = s.Reps[3];
+    state = s.State;
+    unpackSize = s.UnpackSize;
+    nextSnapshot = s.InPos + SnapshotInterval;
+    DropSnapshots(fromSnapshot + 1);
+  }
+  
+  for (;;)
+  {
+    if (unpackSizeDefined && unpackSize == 0 && !markerIsMandatory)
+      if (RangeDec.IsFinishedOK())
+        return LZMA_RES_FINISHED_WITHOUT_MARKER;
+
+    if (StopOnCorruption && RangeDec.Corrupted)
+      return LZMA_RES_ERROR;
+
+    if (SnapshotInterval != 0 && RangeDec.InStream->Processed >= nextSnapshot)
+    {
+      TakeSnapshot(state, rep0, rep1, rep2, rep3, unpackSize);
+      nextSnapshot = RangeDec.InStream->Processed + SnapshotInterval;
+    }
+
+    if (Perplexities.size() + kMatchMaxLen > Perplexities.capacity())
+      GrowOutput(unpackSizeDefined, unpackSize);
+
+    unsigned posState = OutWindow.TotalPos & ((1 << pb) - 1);
+
+    if (RangeDec.DecodeBit(&IsMatch[(state << kNumPosBitsMax) + posState]) == 0)
+    {
+      if (unpackSizeDefined && unpackSize == 0)
+        return LZMA_RES_ERROR;
+      DecodeLiteral(state, rep0);
+      PushPerplexities(1);
+      Literals.push_back(1);
+      NumLiterals++;
+      state = UpdateState_Literal(state);
+      unpackSize--;
+      continue;
+    }
+    
+    unsigned len;
+    
+    if (RangeDec.DecodeBit(&IsRep[state]) != 0)
+    {
+      if (unpackSizeDefined && unpackSize == 0)
+        return LZMA_RES_ERROR;
+      if (OutWindow.IsEmpty())
+        return LZMA_RES_ERROR;
+      if (RangeDec.DecodeBit(&IsRepG0[state]) == 0)
+      {
+        if (RangeDec.DecodeBit(&IsRep0Long[(state << kNumPosBitsMax) + posState]) == 0)
+        {
+          state = UpdateState_ShortRep(state);
+          OutWindow.PutByte(OutWindow.GetByte(rep0 + 1));
+          PushPerplexities(1);
+          Literals.push_back(0);
+          NumShortReps++;
+          unpackSize--;
+          continue;
+        }
+      }
+      else
+      {
+        UInt32 dist;
+        if (RangeDec.DecodeBit(&IsRepG1[state]) == 0)
+          dist = rep1;
+        else
+        {
+          if (RangeDec.DecodeBit(&IsRepG2[state]) == 0)
+            dist = rep2;
+          else
+          {
+            dist = rep3;
+            rep3 = rep2;
+          }
+          rep2 = rep1;
+        }
+        rep1 = rep0;
+        rep0 = dist;
+      }
+      len = RepLenDecoder.Decode(&RangeDec, posState);
+      state = UpdateState_Rep(state);
+      NumReps++;
+    }
+    else
+    {
+      rep3 = rep2;
+      rep2 = rep1;
+      rep1 = rep0;
+      len = LenDecoder.Decode(&RangeDec, posState);
+      state = UpdateState_Match(state);
+      rep0 = DecodeDistance(len);
+      if (rep0 == 0xFFFFFFFF)
+        return RangeDec.IsFinishedOK() ?
+            LZMA_RES_FINISHED_WITH_MARKER :
+            LZMA_RES_ERROR;
+      NumMatches++;
+
+      if (unpackSizeDefined && unpackSize == 0)
+        return LZMA_RES_ERROR;
+      if (rep0 >= dictSize || !OutWindow.CheckDistance(rep0))
+        return LZMA_RES_ERROR;
+    }
+    len += kMatchMinLen;
+    bool isError = false;
+    if (unpackSizeDefined && unpackSize < len)
+    {
+      len = (unsigned)unpackSize;
+      isError = true;
+    }
+    OutWindow.CopyMatch(rep0 + 1, len);
+    Literals.insert(Literals.end(), len, 0);
+    PushPerplexities(len);
+    unpackSize -= len;
+    if (isError)
+      return LZMA_RES_ERROR;
+  }
+}
+
+void LzmaDecodeHeader(CInputStream &inStream, CLzmaDecoder &lzmaDecoder, CMemoryBudget &budget)
+{
+  Byte header[13];
+  int i;
+  for (i = 0; i < 13; i++)
+    header[i] = inStream.ReadByte();
+
+  lzmaDecoder.DecodeProperties(header);
+
+  UInt64 unpackSize = 0;
+  bool unpackSizeDefined = false;
+  for (i = 0; i < 8; i++)
+  {
+    Byte b = header[5 + i];
+    if (b != 0xFF)
+      unpackSizeDefined = true;
+    unpackSize |= (UInt64)b << (8 * i);
+  }
+
+  lzmaDecoder.markerIsMandatory = !unpackSizeDefined;
+  lzmaDecoder.unpackSizeDefined = unpackSizeDefined;
+  lzmaDecoder.unpackSize = unpackSize;
+
+  lzmaDecoder.RangeDec.InStream = &inStream;
+  lzmaDecoder.Budget = &budget;
+
+  try {
+    lzmaDecoder.Create(unpackSizeDefined, unpackSize);
+  } catch (const std::bad_alloc &) {
+    throw "Out of memory";
+  }
+}
+
+int LzmaDecodeData(CLzmaDecoder &lzmaDecoder, int fromSnapshot)
+{
+  try {
+    return lzmaDecoder.Decode(lzmaDecoder.unpackSizeDefined, lzmaDecoder.unpackSize, fromSnapshot);
+  } catch (const std::bad_alloc &) {
+    throw "Out of memory";
+  }
+}
+
+int LzmaDecodeStream(CInputStream &inStream, CLzmaDecoder &lzmaDecoder, CMemoryBudget &budget)
+{
+  LzmaDecodeHeader(inStream, lzmaDecoder, budget);
+  return LzmaDecodeData(lzmaDecoder);
+}
@@ -0,0 +1,643 @@
+/* LzmaDec.hpp -- LZMA Reference Decoder
+2015-06-14 : Igor Pavlov : Public domain */
+
+// This code implements LZMA file decoding according to LZMA specification.
+// This code is not optimized for speed.
+//
+// Besides the decoded bytes, CLzmaDecoder records the cost in bits of every
+// output byte (Perplexities) and whether it was coded as a literal.
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include "baseline.hpp"
+#include "litstats.hpp"
+
+#ifdef _MSC_VER
+  #pragma warning(disable : 4710) // function not inlined
+  #pragma warning(disable : 4996) // This function or variable may be unsafe
+#endif
+
+typedef unsigned char Byte;
+typedef unsigned short UInt16;
+
+#ifdef _LZMA_UINT32_IS_ULONG
+  typedef unsigned long UInt32;
+#else
+  typedef unsigned int UInt32;
+#endif
+
+#if defined(_MSC_VER) || defined(__BORLANDC__)
+  typedef unsigned __int64 UInt64;
+#else
+  typedef unsigned long long int UInt64;
+#endif
+
+
+struct CInputStream
+{
+  FILE *File;
+  const Byte *Buf;  // read from memory instead of File when set
+  UInt64 Size;
+  UInt64 Processed;
+  
+  CInputStream(): File(NULL), Buf(NULL), Size(0) {}
+
+  void Init() { Processed = 0; }
+
+  Byte ReadByte()
+  {
+    if (Buf)
+    {
+      if (Processed >= Size)
+        throw "Unexpected end of file";
+      return Buf[Processed++];
+    }
+    int c = getc(File);
+    if (c < 0)
+      throw "Unexpected end of file";
+    Processed++;
+    return (Byte)c;
+  }
+};
+
+
+// Tracks memory allocated for decoding so that a memory limit can fail
+// cleanly instead of the process being OOM-killed. May be shared between
+// threads. A budget with a Parent charges it too and gives its memory back
+// to it when destroyed, for decoders that come and go under a shared limit.
+struct CMemoryBudget
+{
+  UInt64 Limit;  // 0 means no limit
+  std::atomic<UInt64> Used;
+  CMemoryBudget *Parent;
+
+  CMemoryBudget(): Limit(0), Used(0), Parent(NULL) {}
+  ~CMemoryBudget()
+  {
+    if (Parent)
+      Parent->Release(Used);
+  }
+
+  void Reserve(UInt64 size)
+  {
+    UInt64 used = Used += size;
+    if (Parent)
+      Parent->Reserve(size);
+    if (Limit != 0 && used > Limit)
+      throw "Memory limit exceeded";
+  }
+
+  void Release(UInt64 size) { Used -= size; }
+};
+
+// Errors that depend on the memory available rather than on the input.
+inline bool IsResourceError(const char *e)
+{
+  return !strcmp(e, "Out of memory") || !strcmp(e, "Memory limit exceeded");
+}
+
+
+struct COutStream
+{
+  std::vector<Byte> Data;
+  CBaselineModel *Baseline;  // optional, fed every decoded byte
+
+  COutStream(): Baseline(NULL) {}
+
+  void WriteByte(Byte b)
+  {
+    Data.push_back(b);
+    if (Baseline)
+      Baseline->Add(b);
+  }
+};
+
+
+#define kOutWindowInitSize (1 << 16)
+
+class COutWindow
+{
+  Byte *Buf;
+  UInt32 Pos;
+  UInt32 Size;
+  UInt32 Allocated;  // grows up to Size while the window is not yet full
+  bool IsFull;
+
+  void Grow()
+  {
+    UInt32 newSize = Allocated > Size / 2 ? Size : Allocated * 2;
+    Budget->Reserve(newSize - Allocated);
+    Byte *newBuf = new Byte[newSize];
+    memcpy(newBuf, Buf, Pos);
+    delete []Buf;
+    Buf = newBuf;
+    Allocated = newSize;
+  }
+
+public:
+  unsigned TotalPos;
+  COutStream OutStream;
+  CMemoryBudget *Budget;
+
+  COutWindow(): Buf(NULL) {}
+  ~COutWindow() { delete []Buf; }
+ 
+  // The window never holds more than the declared unpack size, so only that
+  // much is allocated up front; otherwise it grows on demand up to dictSize.
+  void Create(UInt32 dictSize, bool unpackSizeDefined, UInt64 unpackSize)
+  {
+    Allocated = dictSize;
+    if (unpackSizeDefined && unpackSize < Allocated)
+      Allocated = (UInt32)unpackSize;
+    else if (!unpackSizeDefined && kOutWindowInitSize < Allocated)
+      Allocated = kOutWindowInitSize;
+    if (Allocated == 0)
+      Allocated = 1;
+    Budget->Reserve(Allocated);
+    Buf = new Byte[Allocated];
+    Pos = 0;
+    Size = dictSize;
+    IsFull = false;
+    TotalPos = 0;
+  }
+
+  void PutByte(Byte b)
+  {
+    TotalPos++;
+    if (Pos == Allocated)
+      Grow();
+    Buf[Pos++] = b;
+    if (Pos == Size)
+    {
+      Pos = 0;
+      IsFull = true;
+    }
+    OutStream.WriteByte(b);
+  }
+
+  Byte GetByte(UInt32 dist) const
+  {
+    return Buf[dist <= Pos ? Pos - dist : Size - dist + Pos];
+  }
+
+  void CopyMatch(UInt32 dist, unsigned len)
+  {
+    for (; len > 0; len--)
+      PutByte(GetByte(dist));
+  }
+
+  bool CheckDistance(UInt32 dist) const
+  {
+    return dist <= Pos || IsFull;
+  }
+
+  bool IsEmpty() const
+  {
+    return Pos == 0 && !IsFull;
+  }
+
+  // Truncates the output to totalPos bytes and refills the window from it.
+  void Rewind(UInt64 totalPos)
+  {
+    std::vector<Byte> &data = OutStream.Data;
+    data.resize(totalPos);
+    Pos = 0;
+    while (Allocated < std::min(totalPos, (UInt64)Size))
+      Grow();
+    Pos = (UInt32)(totalPos % Size);
+    IsFull = totalPos >= Size;
+    TotalPos = (unsigned)totalPos;
+    memcpy(Buf, data.data() + totalPos - Pos, Pos);
+    if (IsFull)
+      memcpy(Buf + Pos, data.data() + totalPos - Size, Size - Pos);
+  }
+};
+
+
+#define kNumBitModelTotalBits 11
+#define kNumMoveBits 5
+
+typedef UInt16 CProb;
+
+#define PROB_INIT_VAL ((1 << kNumBitModelTotalBits) / 2)
+
+#define INIT_PROBS(p) \
+ { for (unsigned i = 0; i < sizeof(p) / sizeof(p[0]); i++) p[i] = PROB_INIT_VAL; }
+
+class CRangeDecoder
+{
+  UInt32 Range;
+  UInt32 Code;
+
+  void Normalize();
+
+public:
+
+  CInputStream *InStream;
+  bool Corrupted;
+  float Perplexity;
+  UInt64 NumNormalizations;
+
+  bool Init();
+  bool IsFinishedOK() const { return Code == 0; }
+
+  UInt32 DecodeDirectBits(unsigned numBits);
+  unsigned DecodeBit(CProb *prob);
+};
+
+unsigned BitTreeReverseDecode(CProb *probs, unsigned numBits, CRangeDecoder *rc);
+
+template <unsigned NumBits>
+class CBitTreeDecoder
+{
+  CProb Probs[(unsigned)1 << NumBits];
+
+public:
+
+  void Init()
+  {
+    INIT_PROBS(Probs);
+  }
+
+  unsigned Decode(CRangeDecoder *rc)
+  {
+    unsigned m = 1;
+    for (unsigned i = 0; i < NumBits; i++)
+      m = (m << 1) + rc->DecodeBit(&Probs[m]);
+    return m - ((unsigned)1 << NumBits);
+  }
+
+  unsigned ReverseDecode(CRangeDecoder *rc)
+  {
+    return BitTreeReverseDecode(Probs, NumBits, rc);
+  }
+};
+
+#define kNumPosBitsMax 4
+
+#define kNumStates 12
+#define kNumLenToPosStates 4
+#define kNumAlignBits 4
+#define kStartPosModelIndex 4
+#define kEndPosModelIndex 14
+#define kNumFullDistances (1 << (kEndPosModelIndex >> 1))
+#define kMatchMinLen 2
+#define kMatchMaxLen (kMatchMinLen + 16 + 256 - 1)
+
+class CLenDecoder
+{
+  CProb Choice;
+  CProb Choice2;
+  CBitTreeDecoder<3> LowCoder[1 << kNumPosBitsMax];
+  CBitTreeDecoder<3> MidCoder[1 << kNumPosBitsMax];
+  CBitTreeDecoder<8> HighCoder;
+
+public:
+
+  void Init()
+  {
+    Choice = PROB_INIT_VAL;
+    Choice2 = PROB_INIT_VAL;
+    HighCoder.Init();
+    for (unsigned i = 0; i < (1 << kNumPosBitsMax); i++)
+    {
+      LowCoder[i].Init();
+      MidCoder[i].Init();
+    }
+  }
+
+  unsigned Decode(CRangeDecoder *rc, unsigned posState)
+  {
+    if (rc->DecodeBit(&Choice) == 0)
+      return LowCoder[posState].Decode(rc);
+    if (rc->DecodeBit(&Choice2) == 0)
+      return 8 + MidCoder[posState].Decode(rc);
+    return 16 + HighCoder.Decode(rc);
+  }
+};
+unsigned UpdateState_Literal(unsigned state);
+unsigned UpdateState_Match(unsigned state);
+unsigned UpdateState_Rep(unsigned state);
+unsigned UpdateState_ShortRep(unsigned state);
+
+#define LZMA_DIC_MIN (1 << 12)
+
+#define kNumLitProbs 0x300
+#define kOutputInitSize (1 << 16)
+
+// Decoder state between two packets. Resuming from a snapshot gives the same
+// result as decoding from the start as long as the first InPos bytes of the
+// input are unchanged. The dictionary is not saved but rebuilt from the
+// output.
+struct CLzmaSnapshot
+{
+  UInt64 InPos;   // compressed bytes read, including the header
+  UInt64 OutPos;  // bytes decoded
+  double TotalCost;
+  CRangeDecoder RangeDec;
+  unsigned State;
+  UInt32 Reps[4];
+  UInt64 UnpackSize;
+  UInt64 NumLiterals, NumMatches, NumReps, NumShortReps;
+
+  CBitTreeDecoder<6> PosSlotDecoder[kNumLenToPosStates];
+  CBitTreeDecoder<kNumAlignBits> AlignDecoder;
+  CProb PosDecoders[1 + kNumFullDistances - kEndPosModelIndex];
+  CProb IsMatch[kNumStates << kNumPosBitsMax];
+  CProb IsRep[kNumStates];
+  CProb IsRepG0[kNumStates];
+  CProb IsRepG1[kNumStates];
+  CProb IsRepG2[kNumStates];
+  CProb IsRep0Long[kNumStates << kNumPosBitsMax];
+  CLenDecoder LenDecoder;
+  CLenDecoder RepLenDecoder;
+  std::vector<UInt32> LitStates;  // literal tables allocated so far
+  std::vector<CProb> LitProbs;    // kNumLitProbs for each of them
+
+  static UInt64 Memory(size_t numLitStates)
+  {
+    return sizeof(CLzmaSnapshot) + numLitStates * (sizeof(UInt32) + kNumLitProbs * sizeof(CProb));
+  }
+};
+
+class CLzmaDecoder
+{
+public:
+  CRangeDecoder RangeDec;
+  COutWindow OutWindow;
+  std::vector<float> Perplexities;
+  std::vector<Byte> Literals;  // 1 if the byte was coded as a literal
+  CMemoryBudget *Budget;
+  CLiteralStats *LitStats;     // optional, fed every literal
+
+  bool markerIsMandatory;
+  bool StopOnCorruption;  // give up as soon as the range coder sees corruption
+  bool unpackSizeDefined;
+  UInt64 unpackSize;
+  unsigned lc, pb, lp;
+  UInt32 dictSize;
+  UInt32 dictSizeInProperties;
+
+  void DecodeProperties(const Byte *properties)
+  {
+    unsigned d = properties[0];
+    if (d >= (9 * 5 * 5))
+      throw "Incorrect LZMA properties";
+    lc = d % 9;
+    d /= 9;
+    pb = d / 5;
+    lp = d % 5;
+    dictSizeInProperties = 0;
+    for (int i = 0; i < 4; i++)
+      dictSizeInProperties |= (UInt32)properties[i + 1] << (8 * i);
+    dictSize = dictSizeInProperties;
+    if (dictSize < LZMA_DIC_MIN)
+      dictSize = LZMA_DIC_MIN;
+  }
+
+  // When non-zero, Decode saves a snapshot in Snapshots about every
+  // SnapshotInterval bytes of compressed input. The input has to be read
+  // from memory to be able to resume from them.
+  UInt64 SnapshotInterval;
+  std::vector<CLzmaSnapshot> Snapshots;
+
+  CLzmaDecoder(): LitStats(NULL), StopOnCorruption(false), SnapshotInterval(0), LitProbs(NULL) {}
+  ~CLzmaDecoder()
+  {
+    if (LitProbs)
+      for (UInt32 i = 0; i < ((UInt32)1 << (lc + lp)); i++)
+        delete []LitProbs[i];
+    delete []LitProbs;
+  }
+
+  void Create(bool unpackSizeDefined, UInt64 unpackSize)
+  {
+    OutWindow.Budget = Budget;
+    OutWindow.Create(dictSize, unpackSizeDefined, unpackSize);
+    CreateLiterals();
+    if (LitStats)
+    {
+      Budget->Reserve(CLiteralStats::Memory(lc, lp));
+      LitStats->Create(lc, lp);
+    }
+  }
+
+  // Decodes from the start, or from Snapshots[fromSnapshot] after dropping
+  // the snapshots that follow it.
+  int Decode(bool unpackSizeDefined, UInt64 unpackSize, int fromSnapshot = -1);
+
+  // Index of the last snapshot that only depends on the first inPos bytes of
+  // the input, -1 if there is none.
+  int FindSnapshot(UInt64 inPos) const
+  {
+    int i = (int)Snapshots.size() - 1;
+    while (i >= 0 && Snapshots[i].InPos > inPos)
+      i--;
+    return i;
+  }
+
+  // Packets decoded so far, by kind.
+  UInt64 NumLiterals;
+  UInt64 NumMatches;
+  UInt64 NumReps;
+  UInt64 NumShortReps;
+  double TotalCost;  // sum of Perplexities
+  
+
+private:
+
+  // One table of kNumLitProbs per literal context, allocated on first use:
+  // lc + lp = 12 would otherwise cost 12 MB even for a tiny stream.
+  CProb **LitProbs;
+
+  void CreateLiterals()
+  {
+    UInt32 num = (UInt32)1 << (lc + lp);
+    Budget->Reserve(num * sizeof(CProb *));
+    LitProbs = new CProb *[num];
+    for (UInt32 i = 0; i < num; i++)
+      LitProbs[i] = NULL;
+  }
+  
+  void InitLiterals()
+  {
+    UInt32 num = (UInt32)1 << (lc + lp);
+    for (UInt32 i = 0; i < num; i++)
+      if (LitProbs[i])
+        for (UInt32 j = 0; j < kNumLitProbs; j++)
+          LitProbs[i][j] = PROB_INIT_VAL;
+  }
+
+  CProb *GetLitProbs(unsigned litState)
+  {
+    CProb *probs = LitProbs[litState];
+    if (!probs)
+    {
+      Budget->Reserve(kNumLitProbs * sizeof(CProb));
+      probs = LitProbs[litState] = new CProb[kNumLitProbs];
+      for (UInt32 j = 0; j < kNumLitProbs; j++)
+        probs[j] = PROB_INIT_VAL;
+    }
+    return probs;
+  }
+
+  // The per-byte outputs are grown here, one packet ahead of the decoder,
+  // rather than by push_back so that their memory is charged to the budget.
+  // They never need to hold more than the declared unpack size.
+  void GrowOutput(bool unpackSizeDefined, UInt64 unpackSize)
+  {
+    UInt64 size = Perplexities.size();
+    UInt64 cap = Perplexities.capacity();
+    UInt64 newCap = std::max(cap * 2, (UInt64)kOutputInitSize);
+    if (unpackSizeDefined && newCap > size + unpackSize)
+      newCap = size + unpackSize;
+    if (newCap <= cap)
+      return;
+    CBaselineModel *baseline = OutWindow.OutStream.Baseline;
+    Budget->Reserve((newCap - cap) * (2 * sizeof(Byte) + (baseline ? 4 : 1) * sizeof(float)));
+    OutWindow.OutStream.Data.reserve(newCap);
+    Perplexities.reserve(newCap);
+    Literals.reserve(newCap);
+    if (baseline)
+    {
+      baseline->Order0Cost.reserve(newCap);
+      baseline->Order1Cost.reserve(newCap);
+      baseline->MixCost.reserve(newCap);
+    }
+  }
+  
+  void DecodeLiteral(unsigned state, UInt32 rep0)
+  {
+    unsigned prevByte = 0;
+    if (!OutWindow.IsEmpty())
+      prevByte = OutWindow.GetByte(1);
+    
+    unsigned symbol = 1;
+    unsigned litState = ((OutWindow.TotalPos & ((1 << lp) - 1)) << lc) + (prevByte >> (8 - lc));
+    CProb *probs = GetLitProbs(litState);
+    float perplexity = RangeDec.Perplexity;
+    
+    if (state >= 7)
+    {
+      unsigned matchByte = OutWindow.GetByte(rep0 + 1);
+      do
+      {
+        unsigned matchBit = (matchByte >> 7) & 1;
+        matchByte <<= 1;
+        unsigned bit = RangeDec.DecodeBit(&probs[((1 + matchBit) << 8) + symbol]);
+        symbol = (symbol << 1) | bit;
+        if (matchBit != bit)
+          break;
+      }
+      while (symbol < 0x100);
+    }
+    while (symbol < 0x100)
+      symbol = (symbol << 1) | RangeDec.DecodeBit(&probs[symbol]);
+    if (LitStats)
+      LitStats->Add(litState, OutWindow.TotalPos, prevByte, symbol - 0x100, state >= 7,
+          RangeDec.Perplexity - perplexity);
+    OutWindow.PutByte((Byte)(symbol - 0x100));
+  }
+
+  CBitTreeDecoder<6> PosSlotDecoder[kNumLenToPosStates];
+  CBitTreeDecoder<kNumAlignBits> AlignDecoder;
+  CProb PosDecoders[1 + kNumFullDistances - kEndPosModelIndex];
+  
+  void InitDist()
+  {
+    for (unsigned i = 0; i < kNumLenToPosStates; i++)
+      PosSlotDecoder[i].Init();
+    AlignDecoder.Init();
+    INIT_PROBS(PosDecoders);
+  }
+  
+  unsigned DecodeDistance(unsigned len)
+  {
+    unsigned lenState = len;
+    if (lenState > kNumLenToPosStates - 1)
+      lenState = kNumLenToPosStates - 1;
+    
+    unsigned posSlot = PosSlotDecoder[lenState].Decode(&RangeDec);
+    if (posSlot < 4)
+      return posSlot;
+    
+    unsigned numDirectBits = (unsigned)((posSlot >> 1) - 1);
+    UInt32 dist = ((2 | (posSlot & 1)) << numDirectBits);
+    if (posSlot < kEndPosModelIndex)
+      dist += BitTreeReverseDecode(PosDecoders + dist - posSlot, numDirectBits, &RangeDec);
+    else
+    {
+      dist += RangeDec.DecodeDirectBits(numDirectBits - kNumAlignBits) << kNumAlignBits;
+      dist += AlignDecoder.ReverseDecode(&RangeDec);
+    }
+    return dist;
+  }
+
+  void PushPerplexities(unsigned len)
+  {
+    for (int i = 0; i < len; i++) {
+      Perplexities.push_back(RangeDec.Perplexity/len);
+    }
+    TotalCost += RangeDec.Perplexity;
+    RangeDec.Perplexity = 0.f;
+  }
+
+  void TakeSnapshot(unsigned state, UInt32 rep0, UInt32 rep1, UInt32 rep2, UInt32 rep3, UInt64 unpackSize);
+  void RestoreSnapshot(const CLzmaSnapshot &s);
+  void DropSnapshots(size_t from);
+
+  CProb IsMatch[kNumStates << kNumPosBitsMax];
+  CProb IsRep[kNumStates];
+  CProb IsRepG0[kNumStates];
+  CProb IsRepG1[kNumStates];
+  CProb IsRepG2[kNumStates];
+  CProb IsRep0Long[kNumStates << kNumPosBitsMax];
+
+  CLenDecoder LenDecoder;
+  CLenDecoder RepLenDecoder;
+
+  void Init()
+  {
+    InitLiterals();
+    InitDist();
+
+    INIT_PROBS(IsMatch);
+    INIT_PROBS(IsRep);
+    INIT_PROBS(IsRepG0);
+    INIT_PROBS(IsRepG1);
+    INIT_PROBS(IsRepG2);
+    INIT_PROBS(IsRep0Long);
+
+    LenDecoder.Init();
+    RepLenDecoder.Init();
+
+    NumLiterals = 0;
+    NumMatches = 0;
+    NumReps = 0;
+    NumShortReps = 0;
+    TotalCost = 0;
+  }
+};
+    
+
+#define LZMA_RES_ERROR                   0
+#define LZMA_RES_FINISHED_WITH_MARKER    1
+#define LZMA_RES_FINISHED_WITHOUT_MARKER 2
+
+// Reads the 13-byte .lzma header from inStream and allocates the decoder.
+// Throws on I/O errors, invalid properties and when the memory budget is
+// exceeded.
+void LzmaDecodeHeader(CInputStream &inStream, CLzmaDecoder &lzmaDecoder, CMemoryBudget &budget);
+
+// Decodes the stream following the header, or the rest of it from a snapshot
+// (see CLzmaDecoder::Decode). Returns one of the LZMA_RES_* codes; throws like
+// LzmaDecodeHeader.
+int LzmaDecodeData(CLzmaDecoder &lzmaDecoder, int fromSnapshot = -1);
+
+// LzmaDecodeHeader followed by LzmaDecodeData.
+int LzmaDecodeStream(CInputStream &inStream, CLzmaDecoder &lzmaDecoder, CMemoryBudget &budget);
@@ -1,594 +1,31 @@
 /* LzmaSpec.c -- LZMA Reference Decoder
 2015-06-14 : Igor Pavlov : Public domain */
 
-// This code implements LZMA file decoding according to LZMA specification.
-// This code is not optimized for speed.
+// Visualises the per-byte cost of an LZMA stream decoded by LzmaDec.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <string.h>
 #include <iostream>
 #include <iomanip>
 #include <vector>
 #include <algorithm>
+#include <thread>
+#include <chrono>
+#include <new>
+#include <sys/stat.h>
 #ifndef _MSC_VER
 #include <unistd.h>
+#include <sys/resource.h>
 #endif
+#include "LzmaDec.hpp"
 #include "realcolor.hpp"
-
-#ifdef _MSC_VER
-  #pragma warning(disable : 4710) // function not inlined
-  #pragma warning(disable : 4996) // This function or variable may be unsafe
-#endif
-
-typedef unsigned char Byte;
-typedef unsigned short UInt16;
-
-#ifdef _LZMA_UINT32_IS_ULONG
-  typedef unsigned long UInt32;
-#else
-  typedef unsigned int UInt32;
-#endif
-
-#if defined(_MSC_VER) || defined(__BORLANDC__)
-  typedef unsigned __int64 UInt64;
-#else
-  typedef unsigned long long int UInt64;
-#endif
-
-
-struct CInputStream
-{
-  FILE *File;
-  UInt64 Processed;
-  
-  void Init() { Processed = 0; }
-
-  Byte ReadByte()
-  {
-    int c = getc(File);
-    if (c < 0)
-      throw "Unexpected end of file";
-    Processed++;
-    return (Byte)c;
-  }
-};
-
-
-struct COutStream
-{
-  std::vector<Byte> Data;
-
-  void WriteByte(Byte b)
-  {
-    Data.push_back(b);
-  }
-};
-
-
-class COutWindow
-{
-  Byte *Buf;
-  UInt32 Pos;
-  UInt32 Size;
-  bool IsFull;
-
-public:
-  unsigned TotalPos;
-  COutStream OutStream;
-
-  COutWindow(): Buf(NULL) {}
-  ~COutWindow() { delete []Buf; }
- 
-  void Create(UInt32 dictSize)
-  {
-    Buf = new Byte[dictSize];
-    Pos = 0;
-    Size = dictSize;
-    IsFull = false;
-    TotalPos = 0;
-  }
-
-  void PutByte(Byte b)
-  {
-    TotalPos++;
-    Buf[Pos++] = b;
-    if (Pos == Size)
-    {
-      Pos = 0;
-      IsFull = true;
-    }
-    OutStream.WriteByte(b);
-  }
-
-  Byte GetByte(UInt32 dist) const
-  {
-    return Buf[dist <= Pos ? Pos - dist : Size - dist + Pos];
-  }
-
-  void CopyMatch(UInt32 dist, unsigned len)
-  {
-    for (; len > 0; len--)
-      PutByte(GetByte(dist));
-  }
-
-  bool CheckDistance(UInt32 dist) const
-  {
-    return dist <= Pos || IsFull;
-  }
-
-  bool IsEmpty() const
-  {
-    return Pos == 0 && !IsFull;
-  }
-};
-
-
-#define kNumBitModelTotalBits 11
-#define kNumMoveBits 5
-
-typedef UInt16 CProb;
-
-#define PROB_INIT_VAL ((1 << kNumBitModelTotalBits) / 2)
-
-#define INIT_PROBS(p) \
- { for (unsigned i = 0; i < sizeof(p) / sizeof(p[0]); i++) p[i] = PROB_INIT_VAL; }
-
-class CRangeDecoder
-{
-  UInt32 Range;
-  UInt32 Code;
-
-  void Normalize();
-
-public:
-
-  CInputStream *InStream;
-  bool Corrupted;
-  float Perplexity;
-
-  bool Init();
-  bool IsFinishedOK() const { return Code == 0; }
-
-  UInt32 DecodeDirectBits(unsigned numBits);
-  unsigned DecodeBit(CProb *prob);
-};
-
-bool CRangeDecoder::Init()
-{
-  Corrupted = false;
-  Range = 0xFFFFFFFF;
-  Code = 0;
-  Perplexity = 0.f;
-
-  Byte b = InStream->ReadByte();
-  
-  for (int i = 0; i < 4; i++)
-    Code = (Code << 8) | InStream->ReadByte();
-  
-  if (b != 0 || Code == Range)
-    Corrupted = true;
-  return b == 0;
-}
-
-#define kTopValue ((UInt32)1 << 24)
-
-void CRangeDecoder::Normalize()
-{
-  if (Range < kTopValue)
-  {
-    Range <<= 8;
-    Code = (Code << 8) | InStream->ReadByte();
-  }
-}
-
-UInt32 CRangeDecoder::DecodeDirectBits(unsigned numBits)
-{
-  Perplexity += numBits;
-  UInt32 res = 0;
-  do
-  {
-    Range >>= 1;
-    Code -= Range;
-    UInt32 t = 0 - ((UInt32)Code >> 31);
-    Code += Range & t;
-    
-    if (Code == Range)
-      Corrupted = true;
-    
-    Normalize();
-    res <<= 1;
-    res += t + 1;
-  }
-  while (--numBits);
-  return res;
-}
-
-unsigned CRangeDecoder::DecodeBit(CProb *prob)
-{
-  unsigned v = *prob;
-  UInt32 bound = (Range >> kNumBitModelTotalBits) * v;
-  unsigned symbol;
-  if (Code < bound)
-  {
-    Perplexity += -log2(v/2048.f);
-    v += ((1 << kNumBitModelTotalBits) - v) >> kNumMoveBits;
-    Range = bound;
-    symbol = 0;
-  }
-  else
-  {
-    Perplexity += -log2(1.f-v/2048.f);
-    v -= v >> kNumMoveBits;
-    Code -= bound;
-    Range -= bound;
-    symbol = 1;
-  }
-  *prob = (CProb)v;
-  Normalize();
-  return symbol;
-}
-
-
-unsigned BitTreeReverseDecode(CProb *probs, unsigned numBits, CRangeDecoder *rc)
-{
-  unsigned m = 1;
-  unsigned symbol = 0;
-  for (unsigned i = 0; i < numBits; i++)
-  {
-    unsigned bit = rc->DecodeBit(&probs[m]);
-    m <<= 1;
-    m += bit;
-    symbol |= (bit << i);
-  }
-  return symbol;
-}
-
-template <unsigned NumBits>
-class CBitTreeDecoder
-{
-  CProb Probs[(unsigned)1 << NumBits];
-
-public:
-
-  void Init()
-  {
-    INIT_PROBS(Probs);
-  }
-
-  unsigned Decode(CRangeDecoder *rc)
-  {
-    unsigned m = 1;
-    for (unsigned i = 0; i < NumBits; i++)
-      m = (m << 1) + rc->DecodeBit(&Probs[m]);
-    return m - ((unsigned)1 << NumBits);
-  }
-
-  unsigned ReverseDecode(CRangeDecoder *rc)
-  {
-    return BitTreeReverseDecode(Probs, NumBits, rc);
-  }
-};
-
-#define kNumPosBitsMax 4
-
-#define kNumStates 12
-#define kNumLenToPosStates 4
-#define kNumAlignBits 4
-#define kStartPosModelIndex 4
-#define kEndPosModelIndex 14
-#define kNumFullDistances (1 << (kEndPosModelIndex >> 1))
-#define kMatchMinLen 2
-
-class CLenDecoder
-{
-  CProb Choice;
-  CProb Choice2;
-  CBitTreeDecoder<3> LowCoder[1 << kNumPosBitsMax];
-  CBitTreeDecoder<3> MidCoder[1 << kNumPosBitsMax];
-  CBitTreeDecoder<8> HighCoder;
-
-public:
-
-  void Init()
-  {
-    Choice = PROB_INIT_VAL;
-    Choice2 = PROB_INIT_VAL;
-    HighCoder.Init();
-    for (unsigned i = 0; i < (1 << kNumPosBitsMax); i++)
-    {
-      LowCoder[i].Init();
-      MidCoder[i].Init();
-    }
-  }
-
-  unsigned Decode(CRangeDecoder *rc, unsigned posState)
-  {
-    if (rc->DecodeBit(&Choice) == 0)
-      return LowCoder[posState].Decode(rc);
-    if (rc->DecodeBit(&Choice2) == 0)
-      return 8 + MidCoder[posState].Decode(rc);
-    return 16 + HighCoder.Decode(rc);
-  }
-};
-
-unsigned UpdateState_Literal(unsigned state)
-{
-  if (state < 4) return 0;
-  else if (state < 10) return state - 3;
-  else return state - 6;
-}
-unsigned UpdateState_Match   (unsigned state) { return state < 7 ? 7 : 10; }
-unsigned UpdateState_Rep     (unsigned state) { return state < 7 ? 8 : 11; }
-unsigned UpdateState_ShortRep(unsigned state) { return state < 7 ? 9 : 11; }
-
-#define LZMA_DIC_MIN (1 << 12)
-
-class CLzmaDecoder
-{
-public:
-  CRangeDecoder RangeDec;
-  COutWindow OutWindow;
-  std::vector<float> Perplexities;
-  std::vector<bool> Literals;
-
-  bool markerIsMandatory;
-  unsigned lc, pb, lp;
-  UInt32 dictSize;
-  UInt32 dictSizeInProperties;
-
-  void DecodeProperties(const Byte *properties)
-  {
-    unsigned d = properties[0];
-    if (d >= (9 * 5 * 5))
-      throw "Incorrect LZMA properties";
-    lc = d % 9;
-    d /= 9;
-    pb = d / 5;
-    lp = d % 5;
-    dictSizeInProperties = 0;
-    for (int i = 0; i < 4; i++)
-      dictSizeInProperties |= (UInt32)properties[i + 1] << (8 * i);
-    dictSize = dictSizeInProperties;
-    if (dictSize < LZMA_DIC_MIN)
-      dictSize = LZMA_DIC_MIN;
-  }
-
-  CLzmaDecoder(): LitProbs(NULL) {}
-  ~CLzmaDecoder() { delete []LitProbs; }
-
-  void Create()
-  {
-    OutWindow.Create(dictSize);
-    CreateLiterals();
-  }
-
-  int Decode(bool unpackSizeDefined, UInt64 unpackSize);
-  
-private:
-
-  CProb *LitProbs;
-
-  void CreateLiterals()
-  {
-    LitProbs = new CProb[(UInt32)0x300 << (lc + lp)];
-  }
-  
-  void InitLiterals()
-  {
-    UInt32 num = (UInt32)0x300 << (lc + lp);
-    for (UInt32 i = 0; i < num; i++)
-      LitProbs[i] = PROB_INIT_VAL;
-  }
-  
-  void DecodeLiteral(unsigned state, UInt32 rep0)
-  {
-    unsigned prevByte = 0;
-    if (!OutWindow.IsEmpty())
-      prevByte = OutWindow.GetByte(1);
-    
-    unsigned symbol = 1;
-    unsigned litState = ((OutWindow.TotalPos & ((1 << lp) - 1)) << lc) + (prevByte >> (8 - lc));
-    CProb *probs = &LitProbs[(UInt32)0x300 * litState];
-    
-    if (state >= 7)
-    {
-      unsigned matchByte = OutWindow.GetByte(rep0 + 1);
-      do
-      {
-        unsigned matchBit = (matchByte >> 7) & 1;
-        matchByte <<= 1;
-        unsigned bit = RangeDec.DecodeBit(&probs[((1 + matchBit) << 8) + symbol]);
-        symbol = (symbol << 1) | bit;
-        if (matchBit != bit)
-          break;
-      }
-      while (symbol < 0x100);
-    }
-    while (symbol < 0x100)
-      symbol = (symbol << 1) | RangeDec.DecodeBit(&probs[symbol]);
-    OutWindow.PutByte((Byte)(symbol - 0x100));
-  }
-
-  CBitTreeDecoder<6> PosSlotDecoder[kNumLenToPosStates];
-  CBitTreeDecoder<kNumAlignBits> AlignDecoder;
-  CProb PosDecoders[1 + kNumFullDistances - kEndPosModelIndex];
-  
-  void InitDist()
-  {
-    for (unsigned i = 0; i < kNumLenToPosStates; i++)
-      PosSlotDecoder[i].Init();
-    AlignDecoder.Init();
-    INIT_PROBS(PosDecoders);
-  }
-  
-  unsigned DecodeDistance(unsigned len)
-  {
-    unsigned lenState = len;
-    if (lenState > kNumLenToPosStates - 1)
-      lenState = kNumLenToPosStates - 1;
-    
-    unsigned posSlot = PosSlotDecoder[lenState].Decode(&RangeDec);
-    if (posSlot < 4)
-      return posSlot;
-    
-    unsigned numDirectBits = (unsigned)((posSlot >> 1) - 1);
-    UInt32 dist = ((2 | (posSlot & 1)) << numDirectBits);
-    if (posSlot < kEndPosModelIndex)
-      dist += BitTreeReverseDecode(PosDecoders + dist - posSlot, numDirectBits, &RangeDec);
-    else
-    {
-      dist += RangeDec.DecodeDirectBits(numDirectBits - kNumAlignBits) << kNumAlignBits;
-      dist += AlignDecoder.ReverseDecode(&RangeDec);
-    }
-    return dist;
-  }
-
-  void PushPerplexities(unsigned len)
-  {
-    for (int i = 0; i < len; i++) {
-      Perplexities.push_back(RangeDec.Perplexity/len);
-    }
-    RangeDec.Perplexity = 0.f;
-  }
-
-  CProb IsMatch[kNumStates << kNumPosBitsMax];
-  CProb IsRep[kNumStates];
-  CProb IsRepG0[kNumStates];
-  CProb IsRepG1[kNumStates];
-  CProb IsRepG2[kNumStates];
-  CProb IsRep0Long[kNumStates << kNumPosBitsMax];
-
-  CLenDecoder LenDecoder;
-  CLenDecoder RepLenDecoder;
-
-  void Init()
-  {
-    InitLiterals();
-    InitDist();
-
-    INIT_PROBS(IsMatch);
-    INIT_PROBS(IsRep);
-    INIT_PROBS(IsRepG0);
-    INIT_PROBS(IsRepG1);
-    INIT_PROBS(IsRepG2);
-    INIT_PROBS(IsRep0Long);
-
-    LenDecoder.Init();
-    RepLenDecoder.Init();
-  }
-};
-    
-
-#define LZMA_RES_ERROR                   0
-#define LZMA_RES_FINISHED_WITH_MARKER    1
-#define LZMA_RES_FINISHED_WITHOUT_MARKER 2
-
-int CLzmaDecoder::Decode(bool unpackSizeDefined, UInt64 unpackSize)
-{
-  if (!RangeDec.Init())
-    return LZMA_RES_ERROR;
-
-  Init();
-
-  UInt32 rep0 = 0, rep1 = 0, rep2 = 0, rep3 = 0;
-  unsigned state = 0;
-  
-  for (;;)
-  {
-    if (unpackSizeDefined && unpackSize == 0 && !markerIsMandatory)
-      if (RangeDec.IsFinishedOK())
-        return LZMA_RES_FINISHED_WITHOUT_MARKER;
-
-    unsigned posState = OutWindow.TotalPos & ((1 << pb) - 1);
-
-    if (RangeDec.DecodeBit(&IsMatch[(state << kNumPosBitsMax) + posState]) == 0)
-    {
-      if (unpackSizeDefined && unpackSize == 0)
-        return LZMA_RES_ERROR;
-      DecodeLiteral(state, rep0);
-      PushPerplexities(1);
-      Literals.push_back(true);
-      state = UpdateState_Literal(state);
-      unpackSize--;
-      continue;
-    }
-    
-    unsigned len;
-    
-    if (RangeDec.DecodeBit(&IsRep[state]) != 0)
-    {
-      if (unpackSizeDefined && unpackSize == 0)
-        return LZMA_RES_ERROR;
-      if (OutWindow.IsEmpty())
-        return LZMA_RES_ERROR;
-      if (RangeDec.DecodeBit(&IsRepG0[state]) == 0)
-      {
-        if (RangeDec.DecodeBit(&IsRep0Long[(state << kNumPosBitsMax) + posState]) == 0)
-        {
-          state = UpdateState_ShortRep(state);
-          OutWindow.PutByte(OutWindow.GetByte(rep0 + 1));
-          PushPerplexities(1);
-          Literals.push_back(false);
-          unpackSize--;
-          continue;
-        }
-      }
-      else
-      {
-        UInt32 dist;
-        if (RangeDec.DecodeBit(&IsRepG1[state]) == 0)
-          dist = rep1;
-        else
-        {
-          if (RangeDec.DecodeBit(&IsRepG2[state]) == 0)
-            dist = rep2;
-          else
-          {
-            dist = rep3;
-            rep3 = rep2;
-          }
-          rep2 = rep1;
-        }
-        rep1 = rep0;
-        rep0 = dist;
-      }
-      len = RepLenDecoder.Decode(&RangeDec, posState);
-      state = UpdateState_Rep(state);
-    }
-    else
-    {
-      rep3 = rep2;
-      rep2 = rep1;
-      rep1 = rep0;
-      len = LenDecoder.Decode(&RangeDec, posState);
-      state = UpdateState_Match(state);
-      rep0 = DecodeDistance(len);
-      if (rep0 == 0xFFFFFFFF)
-        return RangeDec.IsFinishedOK() ?
-            LZMA_RES_FINISHED_WITH_MARKER :
-            LZMA_RES_ERROR;
-
-      if (unpackSizeDefined && unpackSize == 0)
-        return LZMA_RES_ERROR;
-      if (rep0 >= dictSize || !OutWindow.CheckDistance(rep0))
-        return LZMA_RES_ERROR;
-    }
-    len += kMatchMinLen;
-    bool isError = false;
-    if (unpackSizeDefined && unpackSize < len)
-    {
-      len = (unsigned)unpackSize;
-      isError = true;
-    }
-    OutWindow.CopyMatch(rep0 + 1, len);
-    Literals.insert(Literals.end(), len, false);
-    PushPerplexities(len);
-    unpackSize -= len;
-    if (isError)
-      return LZMA_RES_ERROR;
-  }
-}
+#include "lzmadiff.hpp"
+#include "heatmap.hpp"
+#include "lzmascan.hpp"
+#include "rawwriter.hpp"
+#include "lzmaserver.hpp"
 
 //https://www.andrewnoske.com/wiki/Code_-_heatmaps_and_color_gradients
 class ColorGradient
@@ -690,84 +127,580 @@ public:
 };
 
 static void usage(char** argv) {
-  std::cerr << "usage: " << argv[0] << " [--raw] [--jet] [--help] file.lzma" << std::endl;
+  std::cerr << "usage: " << argv[0] << " [--raw] [--jet] [--lits] [--baseline] [--lit-stats out.txt] [--diff old.lzma] [--scan] [--watch] [--serve] [--cache-memory N[K|M|G]] [--precision N] [--max-memory N[K|M|G]] [--stats] [--help] file.lzma" << std::endl;
 }
 
-int main(int argc, char** argv)
+// Phase timers and counters printed as JSON by --stats. They only cost a
+// clock read per phase and a few increments per packet, so they are always on.
+struct CStats
 {
-#ifdef _MSC_VER
-  bool pretty = true;
-#else
-  bool pretty = isatty(STDOUT_FILENO);
-#endif
-  bool jet = false;
-  bool literals = false;
+  enum { kInput, kHeader, kDecode, kNormalise, kAlign, kOutput, kNumPhases };
 
-  if (argc < 2) {
-    usage(argv);
-    return 1;
+  double PhaseSeconds[kNumPhases];
+  UInt64 Literals, Matches, Reps, ShortReps;
+  UInt64 Normalizations;
+  UInt64 BytesIn, BytesOut;
+
+  CStats()
+  {
+    for (int i = 0; i < kNumPhases; i++)
+      PhaseSeconds[i] = 0;
+    Literals = Matches = Reps = ShortReps = 0;
+    Normalizations = 0;
+    BytesIn = BytesOut = 0;
   }
 
-  int fileargind = 1;
-  if (!strcmp(argv[fileargind], "--raw")) {
-    fileargind++;
-    pretty = false;
+  void AddDecoder(const CLzmaDecoder &lzmaDecoder, const CInputStream &inStream)
+  {
+    Literals += lzmaDecoder.NumLiterals;
+    Matches += lzmaDecoder.NumMatches;
+    Reps += lzmaDecoder.NumReps;
+    ShortReps += lzmaDecoder.NumShortReps;
+    Normalizations += lzmaDecoder.RangeDec.NumNormalizations;
+    BytesIn += inStream.Processed;
+    BytesOut += lzmaDecoder.Perplexities.size();
   }
 
-  if (!strcmp(argv[fileargind], "--jet")) {
-    fileargind++;
-    jet = true;
+  // Phases of streams decoded concurrently add up, like CPU time.
+  void Add(const CStats &other)
+  {
+    for (int i = 0; i < kNumPhases; i++)
+      PhaseSeconds[i] += other.PhaseSeconds[i];
+    Literals += other.Literals;
+    Matches += other.Matches;
+    Reps += other.Reps;
+    ShortReps += other.ShortReps;
+    Normalizations += other.Normalizations;
+    BytesIn += other.BytesIn;
+    BytesOut += other.BytesOut;
   }
 
-  if (!strcmp(argv[fileargind], "--lits")) {
-    fileargind++;
-    literals = true;
+  void Print(std::ostream &out) const
+  {
+    static const char *phases[kNumPhases] = { "input", "header", "decode", "normalise", "align", "output" };
+    long peakRss = -1;
+#ifndef _MSC_VER
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+      peakRss = usage.ru_maxrss;
+#endif
+    out << "{\"phases_ms\": {";
+    for (int i = 0; i < kNumPhases; i++)
+      out << (i ? ", " : "") << "\"" << phases[i] << "\": " << PhaseSeconds[i] * 1000;
+    out << "}, \"packets\": {\"literal\": " << Literals
+      << ", \"match\": " << Matches
+      << ", \"rep\": " << Reps
+      << ", \"shortrep\": " << ShortReps
+      << "}, \"normalizations\": " << Normalizations
+      << ", \"bytes_in\": " << BytesIn
+      << ", \"bytes_out\": " << BytesOut
+      << ", \"peak_rss_kb\": " << peakRss
+      << "}" << std::endl;
   }
+};
 
-  if (!strcmp(argv[fileargind], "--help")) {
-    usage(argv);
-    return 0;
+// Adds the time until Stop or the end of the enclosing scope to a phase.
+class CPhaseTimer
+{
+  CStats &Stats;
+  int Phase;
+  bool Running;
+  std::chrono::steady_clock::time_point Start;
+
+public:
+  CPhaseTimer(CStats &stats, int phase): Stats(stats), Phase(phase), Running(true),
+      Start(std::chrono::steady_clock::now()) {}
+  ~CPhaseTimer() { Stop(); }
+
+  void Stop()
+  {
+    if (!Running)
+      return;
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - Start;
+    Stats.PhaseSeconds[Phase] += elapsed.count();
+    Running = false;
   }
+};
 
-  CInputStream inStream;
-  inStream.File = fopen(argv[fileargind], "rb");
-  inStream.Init();
-  if (inStream.File == 0)
+// The compressed file is read in one go so that input and decoding can be
+// timed separately.
+static void ReadFile(const char *path, std::vector<Byte> &data, CMemoryBudget &budget)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == 0)
     throw "Can't open input file";
+  Byte chunk[1 << 16];
+  size_t size;
+  while ((size = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    try {
+      budget.Reserve(size);
+    } catch (const char *) {
+      fclose(file);
+      throw;
+    }
+    data.insert(data.end(), chunk, chunk + size);
+  }
+  bool failed = ferror(file) != 0;
+  fclose(file);
+  if (failed)
+    throw "Can't read input file";
+}
 
-  CLzmaDecoder lzmaDecoder;
+static void DecodeFile(const char *path, CLzmaDecoder &lzmaDecoder, CMemoryBudget &budget, CStats &stats)
+{
+  std::vector<Byte> input;
+  {
+    CPhaseTimer timer(stats, CStats::kInput);
+    ReadFile(path, input, budget);
+  }
 
-  Byte header[13];
-  int i;
-  for (i = 0; i < 13; i++)
-    header[i] = inStream.ReadByte();
+  CInputStream inStream;
+  inStream.Buf = input.data();
+  inStream.Size = input.size();
+  inStream.Init();
 
-  lzmaDecoder.DecodeProperties(header);
+  {
+    CPhaseTimer timer(stats, CStats::kHeader);
+    LzmaDecodeHeader(inStream, lzmaDecoder, budget);
+  }
+  int res;
+  {
+    CPhaseTimer timer(stats, CStats::kDecode);
+    res = LzmaDecodeData(lzmaDecoder);
+  }
+  stats.AddDecoder(lzmaDecoder, inStream);
+
+  if (res == LZMA_RES_ERROR)
+    throw "LZMA decoding error";
 
-  UInt64 unpackSize = 0;
-  bool unpackSizeDefined = false;
-  for (i = 0; i < 8; i++)
+  if (lzmaDecoder.RangeDec.Corrupted)
   {
-    Byte b = header[5 + i];
-    if (b != 0xFF)
-      unpackSizeDefined = true;
-    unpackSize |= (UInt64)b << (8 * i);
+    std::cerr << "Warning: LZMA stream " << path << " is corrupted" << std::endl;
   }
+}
 
-  lzmaDecoder.markerIsMandatory = !unpackSizeDefined;
+#define kDiffBlockSize 256
+#define kDiffTopRegions 20
 
-  lzmaDecoder.RangeDec.InStream = &inStream;
+static void printDiffRegion(const lzmadiff::Region &r, bool total)
+{
+  static const char *kinds[] = { "aligned", "inserted", "deleted" };
+  std::cout << std::setw(9) << kinds[r.Kind];
+  if (total || r.Kind == lzmadiff::kInserted)
+    std::cout << std::setw(12) << "-";
+  else
+    std::cout << std::setw(12) << r.OldPos;
+  if (total || r.Kind == lzmadiff::kDeleted)
+    std::cout << std::setw(12) << "-";
+  else
+    std::cout << std::setw(12) << r.NewPos;
+  std::cout << std::setw(10) << r.Size
+    << std::setw(12) << r.OldCost
+    << std::setw(12) << r.NewCost
+    << std::setw(12) << std::showpos << r.NewCost - r.OldCost << std::noshowpos
+    << std::endl;
+}
 
-  lzmaDecoder.Create();
+static bool byCostChange(const lzmadiff::Region &a, const lzmadiff::Region &b)
+{
+  return fabs(a.NewCost - a.OldCost) > fabs(b.NewCost - b.OldCost);
+}
 
-  int res = lzmaDecoder.Decode(unpackSizeDefined, unpackSize);
+// Decodes both streams concurrently and reports the cost (in bits) of aligned,
+// inserted and deleted content. --raw prints every region, one per line.
+static int diffFiles(const char *oldPath, const char *newPath, bool pretty, CMemoryBudget &budget, CStats &stats)
+{
+  CLzmaDecoder oldDecoder;
+  CLzmaDecoder newDecoder;
+  CStats oldStats;
+  const char *oldError = NULL;
+  std::thread oldThread([&]() {
+    try {
+      DecodeFile(oldPath, oldDecoder, budget, oldStats);
+    } catch (const char *e) {
+      oldError = e;
+    }
+  });
+  const char *newError = NULL;
+  try {
+    DecodeFile(newPath, newDecoder, budget, stats);
+  } catch (const char *e) {
+    newError = e;
+  }
+  oldThread.join();
+  if (oldError)
+    throw oldError;
+  if (newError)
+    throw newError;
+  stats.Add(oldStats);
+
+  std::vector<lzmadiff::Region> regions;
+  {
+    CPhaseTimer timer(stats, CStats::kAlign);
+    budget.Reserve(lzmadiff::AlignMemory(oldDecoder.OutWindow.OutStream.Data.size()));
+    regions = lzmadiff::Align(
+        oldDecoder.OutWindow.OutStream.Data, oldDecoder.Perplexities,
+        newDecoder.OutWindow.OutStream.Data, newDecoder.Perplexities,
+        kDiffBlockSize);
+  }
+  CPhaseTimer timer(stats, CStats::kOutput);
+
+  std::cout << std::fixed << std::setprecision(2);
+  if (!pretty) {
+    for (size_t i = 0; i < regions.size(); i++) {
+      const lzmadiff::Region &r = regions[i];
+      std::cout << "AID"[r.Kind] << " " << r.OldPos << " " << r.NewPos << " " << r.Size
+        << " " << r.OldCost << " " << r.NewCost << "\n";
+    }
+    std::cout << std::flush;
+    return 0;
+  }
 
-  if (res == LZMA_RES_ERROR)
-    throw "LZMA decoding error";
+  lzmadiff::Region totals[3];
+  for (int k = 0; k < 3; k++) {
+    lzmadiff::Region t = { (lzmadiff::RegionKind)k, 0, 0, 0, 0, 0 };
+    totals[k] = t;
+  }
+  std::vector<lzmadiff::Region> byKind[3];
+  for (size_t i = 0; i < regions.size(); i++) {
+    const lzmadiff::Region &r = regions[i];
+    totals[r.Kind].Size += r.Size;
+    totals[r.Kind].OldCost += r.OldCost;
+    totals[r.Kind].NewCost += r.NewCost;
+    byKind[r.Kind].push_back(r);
+  }
+
+  std::cout << "     Kind     Old off     New off      Size    Old bits    New bits       Delta" << std::endl;
+  std::cout << std::string(79, '-') << std::endl;
+  for (int k = 0; k < 3; k++)
+    printDiffRegion(totals[k], true);
+  for (int k = 0; k < 3; k++) {
+    std::vector<lzmadiff::Region> &list = byKind[k];
+    size_t top = std::min(list.size(), (size_t)kDiffTopRegions);
+    std::partial_sort(list.begin(), list.begin() + top, list.end(), byCostChange);
+    if (top == 0)
+      continue;
+    std::cout << std::string(79, '-') << std::endl;
+    for (size_t i = 0; i < top; i++)
+      printDiffRegion(list[i], false);
+  }
+  return 0;
+}
 
-  if (lzmaDecoder.RangeDec.Corrupted)
+// Lists the .lzma streams embedded in an arbitrary file. --raw prints one
+// stream per line.
+static int scanFile(const char *path, bool pretty, CMemoryBudget &budget, CStats &stats)
+{
+  std::vector<Byte> data;
+  {
+    CPhaseTimer timer(stats, CStats::kInput);
+    ReadFile(path, data, budget);
+  }
+  std::vector<lzmascan::Stream> streams;
+  std::vector<uint64_t> noMemory;
   {
-    std::cerr << "Warning: LZMA stream is corrupted" << std::endl;
+    CPhaseTimer timer(stats, CStats::kDecode);
+    streams = lzmascan::Scan(data, budget, noMemory);
+  }
+  stats.BytesIn += data.size();
+  for (size_t i = 0; i < noMemory.size(); i++)
+    std::cerr << "Warning: not enough memory to check for a stream at offset " << noMemory[i] << std::endl;
+
+  CPhaseTimer timer(stats, CStats::kOutput);
+  if (pretty) {
+    std::cout << "      Offset      Packed    Unpacked  lc lp pb        Dict   Bits/byte" << std::endl;
+    std::cout << std::string(79, '-') << std::endl;
+  }
+  std::cout << std::fixed << std::setprecision(2);
+  for (size_t i = 0; i < streams.size(); i++) {
+    const lzmascan::Stream &s = streams[i];
+    stats.BytesOut += s.UnpackSize;
+    if (!pretty) {
+      std::cout << s.Offset << " " << s.PackSize << " " << s.UnpackSize
+        << " " << s.lc << " " << s.lp << " " << s.pb << " " << s.DictSize
+        << " " << s.Cost << "\n";
+      continue;
+    }
+    std::cout << std::setw(12) << s.Offset
+      << std::setw(12) << s.PackSize
+      << std::setw(12) << s.UnpackSize
+      << std::setw(4) << s.lc << std::setw(3) << s.lp << std::setw(3) << s.pb
+      << std::setw(12) << s.DictSize
+      << std::setw(12) << s.Cost / s.UnpackSize
+      << std::endl;
+  }
+  std::cout << std::flush;
+  return 0;
+}
+
+// Compressed bytes between two decoder snapshots in --watch mode. Each costs
+// about 6 KB plus 1.5 KB per literal table in use.
+#define kWatchSnapshotInterval (1 << 14)
+#define kWatchPollMs 200
+
+// Identifies a version of a file without reading it.
+struct CFileStamp
+{
+  UInt64 Size, Time, TimeNs;
+
+  bool Read(const char *path)
+  {
+    struct stat st;
+    if (stat(path, &st) != 0)
+      return false;
+    Size = st.st_size;
+    Time = st.st_mtime;
+#ifdef _MSC_VER
+    TimeNs = 0;
+#else
+    TimeNs = st.st_mtim.tv_nsec;
+#endif
+    return true;
+  }
+
+  bool operator==(const CFileStamp &other) const
+  {
+    return Size == other.Size && Time == other.Time && TimeNs == other.TimeNs;
+  }
+};
+
+// Decodes path, then again whenever it changes until interrupted. Decoding
+// resumes from the last snapshot taken before the first changed compressed
+// byte, and only the output from there on is compared with the previous run.
+// --raw prints one line per run.
+static int watchFile(const char *path, bool pretty, UInt64 memoryLimit)
+{
+  CMemoryBudget budget;
+  budget.Limit = memoryLimit;
+  CLzmaDecoder *lzmaDecoder = NULL;
+  CInputStream inStream;
+  std::vector<Byte> input, oldInput;
+  CFileStamp stamp;
+  bool seen = false;
+
+  if (pretty)
+    std::cerr << "Watching " << path << ", press Ctrl-C to stop" << std::endl;
+  std::cout << std::fixed << std::setprecision(2);
+  for (;; std::this_thread::sleep_for(std::chrono::milliseconds(kWatchPollMs))) {
+    CFileStamp newStamp;
+    if (!newStamp.Read(path) || (seen && newStamp == stamp))
+      continue;
+    stamp = newStamp;
+    seen = true;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    oldInput.swap(input);
+    input.clear();
+    try {
+      CMemoryBudget inputBudget;
+      inputBudget.Limit = memoryLimit;
+      ReadFile(path, input, inputBudget);
+    } catch (const char *e) {
+      std::cerr << "Error: " << e << std::endl;
+      input.swap(oldInput);
+      continue;
+    }
+
+    size_t common = std::min(input.size(), oldInput.size());
+    size_t diff = std::mismatch(input.begin(), input.begin() + common, oldInput.begin()).first - input.begin();
+    if (lzmaDecoder && diff == input.size() && diff == oldInput.size())
+      continue;
+    int from = lzmaDecoder ? lzmaDecoder->FindSnapshot(diff) : -1;
+
+    // The part of the previous result that may change.
+    UInt64 resumeIn = from >= 0 ? lzmaDecoder->Snapshots[from].InPos : 0;
+    UInt64 resumeOut = from >= 0 ? lzmaDecoder->Snapshots[from].OutPos : 0;
+    double oldTotal = 0;
+    std::vector<float> oldCost;
+    std::vector<Byte> oldData;
+    if (lzmaDecoder) {
+      oldTotal = lzmaDecoder->TotalCost;
+      oldCost.assign(lzmaDecoder->Perplexities.begin() + resumeOut, lzmaDecoder->Perplexities.end());
+      std::vector<Byte> &data = lzmaDecoder->OutWindow.OutStream.Data;
+      oldData.assign(data.begin() + resumeOut, data.end());
+    }
+
+    inStream.Buf = input.data();
+    inStream.Size = input.size();
+    int res;
+    try {
+      if (from < 0) {
+        delete lzmaDecoder;
+        budget.Used = 0;
+        lzmaDecoder = new CLzmaDecoder;
+        lzmaDecoder->SnapshotInterval = kWatchSnapshotInterval;
+        inStream.Init();
+        LzmaDecodeHeader(inStream, *lzmaDecoder, budget);
+      }
+      res = LzmaDecodeData(*lzmaDecoder, from);
+    } catch (const char *e) {
+      // The decoder may be half way through a snapshot, start over next time.
+      std::cerr << "Error: " << e << std::endl;
+      delete lzmaDecoder;
+      lzmaDecoder = NULL;
+      continue;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (res == LZMA_RES_ERROR)
+      std::cerr << "Error: LZMA decoding error" << std::endl;
+    else if (lzmaDecoder->RangeDec.Corrupted)
+      std::cerr << "Warning: LZMA stream " << path << " is corrupted" << std::endl;
+
+    const std::vector<float> &cost = lzmaDecoder->Perplexities;
+    const std::vector<Byte> &data = lzmaDecoder->OutWindow.OutStream.Data;
+    size_t n = std::min(oldCost.size(), (size_t)(cost.size() - resumeOut));
+    size_t i = 0;
+    while (i < n && oldCost[i] == cost[resumeOut + i] && oldData[i] == data[resumeOut + i])
+      i++;
+    bool changed = i < n || oldCost.size() != cost.size() - resumeOut;
+    double total = lzmaDecoder->TotalCost;
+
+    if (!pretty) {
+      std::cout << input.size() << " " << cost.size() << " " << resumeIn << " " << resumeOut
+        << " " << (changed ? (long long)(resumeOut + i) : -1LL)
+        << " " << total << " " << total - oldTotal << std::endl;
+      continue;
+    }
+    std::cout << path << ": " << input.size() << " bytes in, " << cost.size() << " bytes out, "
+      << total << " bits (" << std::showpos << total - oldTotal << std::noshowpos << ")" << std::endl
+      << "  decoded from input offset " << resumeIn << " (output " << resumeOut << ") in "
+      << elapsed.count() * 1000 << " ms, ";
+    if (changed)
+      std::cout << "costs change from output byte " << resumeOut + i << std::endl;
+    else
+      std::cout << "costs unchanged" << std::endl;
+  }
+  return 0;
+}
+
+#define kServerDefaultCacheMemory (256 << 20)
+
+// Parses a byte count with an optional K, M or G suffix; 0 on error.
+static UInt64 parseSize(const char *s)
+{
+  char *end;
+  UInt64 size = strtoull(s, &end, 10);
+  switch (*end) {
+    case 'K': case 'k': size <<= 10; end++; break;
+    case 'M': case 'm': size <<= 20; end++; break;
+    case 'G': case 'g': size <<= 30; end++; break;
+  }
+  return *end ? 0 : size;
+}
+
+static int main2(int argc, char** argv)
+{
+#ifdef _MSC_VER
+  bool pretty = true;
+#else
+  bool pretty = isatty(STDOUT_FILENO);
+#endif
+  bool jet = false;
+  bool literals = false;
+  bool baseline = false;
+  const char *litStatsPath = NULL;
+  const char *diffOld = NULL;
+  bool scan = false;
+  bool watch = false;
+  bool serve = false;
+  UInt64 cacheMemory = kServerDefaultCacheMemory;
+  bool printStats = false;
+  int precision = 6;
+  CMemoryBudget budget;
+  CStats stats;
+
+  int fileargind = 1;
+  for (; fileargind < argc && !strncmp(argv[fileargind], "--", 2); fileargind++) {
+    if (!strcmp(argv[fileargind], "--raw")) {
+      pretty = false;
+    } else if (!strcmp(argv[fileargind], "--jet")) {
+      jet = true;
+    } else if (!strcmp(argv[fileargind], "--lits")) {
+      literals = true;
+    } else if (!strcmp(argv[fileargind], "--baseline")) {
+      baseline = true;
+    } else if (!strcmp(argv[fileargind], "--lit-stats") && fileargind + 1 < argc) {
+      litStatsPath = argv[++fileargind];
+    } else if (!strcmp(argv[fileargind], "--diff") && fileargind + 1 < argc) {
+      diffOld = argv[++fileargind];
+    } else if (!strcmp(argv[fileargind], "--precision") && fileargind + 1 < argc) {
+      char *end;
+      precision = (int)strtol(argv[++fileargind], &end, 10);
+      if (*end || precision < 0 || precision > kRawMaxPrecision) {
+        usage(argv);
+        return 1;
+      }
+    } else if (!strcmp(argv[fileargind], "--max-memory") && fileargind + 1 < argc) {
+      budget.Limit = parseSize(argv[++fileargind]);
+      if (budget.Limit == 0) {
+        usage(argv);
+        return 1;
+      }
+    } else if (!strcmp(argv[fileargind], "--scan")) {
+      scan = true;
+    } else if (!strcmp(argv[fileargind], "--watch")) {
+      watch = true;
+    } else if (!strcmp(argv[fileargind], "--serve")) {
+      serve = true;
+    } else if (!strcmp(argv[fileargind], "--cache-memory") && fileargind + 1 < argc) {
+      cacheMemory = parseSize(argv[++fileargind]);
+      if (cacheMemory == 0) {
+        usage(argv);
+        return 1;
+      }
+    } else if (!strcmp(argv[fileargind], "--stats")) {
+      printStats = true;
+    } else if (!strcmp(argv[fileargind], "--help")) {
+      usage(argv);
+      return 0;
+    } else {
+      usage(argv);
+      return 1;
+    }
+  }
+
+  if (fileargind != argc - 1) {
+    usage(argv);
+    return 1;
+  }
+
+  if (watch)
+    return watchFile(argv[fileargind], pretty, budget.Limit);
+
+  if (serve) {
+    unsigned numThreads = std::thread::hardware_concurrency();
+    lzmaserver::Server server(numThreads ? numThreads : 1, cacheMemory, budget.Limit);
+    server.Run(argv[fileargind]);
+    return 0;
+  }
+
+  if (diffOld || scan) {
+    int res = scan ?
+        scanFile(argv[fileargind], pretty, budget, stats) :
+        diffFiles(diffOld, argv[fileargind], pretty, budget, stats);
+    if (printStats)
+      stats.Print(std::cerr);
+    return res;
+  }
+
+  CLzmaDecoder lzmaDecoder;
+  CBaselineModel baselineModel;
+  if (baseline) {
+    budget.Reserve(CBaselineModel::FixedMemory());
+    lzmaDecoder.OutWindow.OutStream.Baseline = &baselineModel;
+  }
+  CLiteralStats litStats;
+  if (litStatsPath)
+    lzmaDecoder.LitStats = &litStats;
+  DecodeFile(argv[fileargind], lzmaDecoder, budget, stats);
+
+  if (litStatsPath) {
+    FILE *file = fopen(litStatsPath, "w");
+    if (file == 0)
+      throw "Can't open literal statistics file";
+    bool ok = litStats.Write(file);
+    if (fclose(file) != 0 || !ok)
+      throw "Can't write literal statistics file";
   }
 
   ColorGradient grad;
@@ -776,33 +709,50 @@ int main(int argc, char** argv)
   } else {
     grad.createViridisHeatMapGradient();
   }
-  double maxPerplexity = *std::max_element(lzmaDecoder.Perplexities.begin(), lzmaDecoder.Perplexities.end());
   int colWidth = 64;
   int scaleFreq = 16;
-  float minForCol = 1.;
-  float maxForCol = 0;
-  float avgForCol = 0;
+  CHeatMap heatMap;
+  {
+    CPhaseTimer timer(stats, CStats::kNormalise);
+    budget.Reserve(CHeatMap::Memory(lzmaDecoder.Perplexities.size(), colWidth));
+    heatMap.Compute(lzmaDecoder.Perplexities, colWidth);
+    if (baseline && pretty)
+      heatMap.ComputeRelative(lzmaDecoder.Perplexities, baselineModel.MixCost, colWidth);
+  }
+  double maxPerplexity = heatMap.MaxCost;
+
+  CPhaseTimer outputTimer(stats, CStats::kOutput);
+
+  std::string colors[kHeatMax + 1];
+  if (pretty) {
+    for (int i = 0; i <= kHeatMax; i++)
+      colors[i] = grad.get(i * 1.f / kHeatMax);
+  }
+  std::string scale = grad.printScale(colWidth);
+  CRawWriter raw(precision);
+
   for (int j = 0; j < lzmaDecoder.OutWindow.OutStream.Data.size(); j++) {
     if (!pretty) {
-      std::cout << lzmaDecoder.Perplexities[j]/maxPerplexity << std::endl;
+      raw.Number(lzmaDecoder.Perplexities[j]/maxPerplexity);
+      if (baseline) {
+        raw.Char(' ');
+        raw.Number(lzmaDecoder.Perplexities[j]/baselineModel.MixCost[j]);
+      }
+      raw.Char('\n');
       continue;
     }
     if (j % colWidth == 0 && (j / colWidth)%scaleFreq == 0) {
-      std::cout << grad.printScale(colWidth) << std::endl;
+      std::cout << scale << std::endl;
     }
-    bool literal = lzmaDecoder.Literals[j];
-    float heat = sqrt(lzmaDecoder.Perplexities[j]/maxPerplexity);
-    avgForCol += heat;
-    maxForCol = std::max(maxForCol, heat);
-    minForCol = std::min(minForCol, heat);
-    if (literals) heat = literal ? 1. : 0.;
+    int heat = heatMap.Levels[j];
+    if (literals) heat = lzmaDecoder.Literals[j] ? kHeatMax : 0;
 
     char byte = lzmaDecoder.OutWindow.OutStream.Data[j];
     if (!std::isprint(byte)) {
       byte = '.';
     }
     std::cout
-      << grad.get(heat)
+      << colors[heat]
       // << std::setfill('0')
       // << std::setw(2)
       // << std::right
@@ -813,17 +763,49 @@ int main(int argc, char** argv)
     //   std::cout << " ";
     // }
     if (j % colWidth == colWidth-1) {
+      int row = j / colWidth;
       std::cout << " "
-        << grad.get(minForCol) << " "
-        << grad.get(avgForCol/colWidth) << " "
-        << grad.get(maxForCol) << " "
+        << colors[heatMap.RowMin[row]] << " "
+        << colors[heatMap.RowAvg[row]] << " "
+        << colors[heatMap.RowMax[row]] << " "
         << realcolor::reset << std::endl;
-      minForCol = 1;
-      maxForCol = 0;
-      avgForCol = 0;
     }
   }
-  std::cout << std::endl;
+  if (!pretty) {
+    raw.Char('\n');
+    raw.Flush();
+  } else {
+    std::cout << std::endl;
+  }
+  if (pretty && baseline) {
+    double total = 0, order0 = 0, order1 = 0, mix = 0;
+    for (size_t j = 0; j < baselineModel.MixCost.size(); j++) {
+      total += lzmaDecoder.Perplexities[j];
+      order0 += baselineModel.Order0Cost[j];
+      order1 += baselineModel.Order1Cost[j];
+      mix += baselineModel.MixCost[j];
+    }
+    std::cout << std::fixed << std::setprecision(2)
+      << "LZMA: " << total << " bits, order-0: " << order0
+      << " bits, order-1: " << order1 << " bits, mixed: " << mix
+      << " bits (LZMA/mixed " << (mix > 0 ? total / mix : 0) << ")" << std::endl;
+  }
+  outputTimer.Stop();
 
+  if (printStats)
+    stats.Print(std::cerr);
   return 0;
 }
+
+int main(int argc, char** argv)
+{
+  try {
+    return main2(argc, argv);
+  } catch (const char *s) {
+    std::cerr << "Error: " << s << std::endl;
+    return 1;
+  } catch (const std::bad_alloc &) {
+    std::cerr << "Error: Out of memory" << std::endl;
+    return 1;
+  }
+}
@@ -0,0 +1,55 @@
+/* LzmaSpec.h -- C API of the LZMA cost analysis library (libLzmaSpec) */
+
+// Decodes an .lzma stream in-process and gives direct access to the per-byte
+// results, so that tools don't have to spawn LzmaSpec and parse its output.
+// The returned pointers stay valid until LzmaSpec_Free is called on the
+// result they were obtained from.
+
+#ifndef LZMASPEC_H
+#define LZMASPEC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32)
+  #define LZMASPEC_API __declspec(dllexport)
+#else
+  #define LZMASPEC_API __attribute__((visibility("default")))
+#endif
+
+// Bumped whenever a function is added or changes meaning.
+#define LZMASPEC_API_VERSION 1
+
+typedef struct CLzmaSpecResult CLzmaSpecResult;
+
+LZMASPEC_API int LzmaSpec_ApiVersion(void);
+
+// Both return NULL only if the result itself can't be allocated; decoding
+// errors are reported by LzmaSpec_GetError. maxMemory is in bytes, 0 means
+// no limit. The buffer passed to LzmaSpec_DecodeBuffer is not retained.
+LZMASPEC_API CLzmaSpecResult *LzmaSpec_DecodeFile(const char *path, unsigned long long maxMemory);
+LZMASPEC_API CLzmaSpecResult *LzmaSpec_DecodeBuffer(const void *data, size_t size, unsigned long long maxMemory);
+LZMASPEC_API void LzmaSpec_Free(CLzmaSpecResult *result);
+
+// NULL if the stream was decoded successfully.
+LZMASPEC_API const char *LzmaSpec_GetError(const CLzmaSpecResult *result);
+// Non-zero if the decoder found the stream to be corrupted but could finish.
+LZMASPEC_API int LzmaSpec_IsCorrupted(const CLzmaSpecResult *result);
+
+// Number of decompressed bytes, which is also the length of the arrays below.
+LZMASPEC_API size_t LzmaSpec_GetSize(const CLzmaSpecResult *result);
+// Decompressed data.
+LZMASPEC_API const unsigned char *LzmaSpec_GetOutput(const CLzmaSpecResult *result);
+// Cost of every decompressed byte in bits.
+LZMASPEC_API const float *LzmaSpec_GetCosts(const CLzmaSpecResult *result);
+// 1 for bytes that were coded as literals, 0 for bytes copied by a match.
+LZMASPEC_API const unsigned char *LzmaSpec_GetLiterals(const CLzmaSpecResult *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
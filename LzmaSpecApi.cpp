@@ -0,0 +1,104 @@
+/* LzmaSpecApi.cpp -- C API of the LZMA cost analysis library */
+
+#include <new>
+#include "LzmaDec.hpp"
+#include "LzmaSpec.h"
+
+struct CLzmaSpecResult
+{
+  CLzmaDecoder Decoder;
+  CMemoryBudget Budget;
+  const char *Error;
+
+  CLzmaSpecResult(): Error(NULL) { Decoder.RangeDec.Corrupted = false; }
+
+  void Decode(CInputStream &inStream)
+  {
+    Error = NULL;
+    try {
+      if (LzmaDecodeStream(inStream, Decoder, Budget) == LZMA_RES_ERROR)
+        Error = "LZMA decoding error";
+    } catch (const char *e) {
+      Error = e;
+    }
+  }
+};
+
+static CLzmaSpecResult *NewResult(unsigned long long maxMemory)
+{
+  CLzmaSpecResult *result = new (std::nothrow) CLzmaSpecResult;
+  if (result)
+    result->Budget.Limit = maxMemory;
+  return result;
+}
+
+int LzmaSpec_ApiVersion(void)
+{
+  return LZMASPEC_API_VERSION;
+}
+
+CLzmaSpecResult *LzmaSpec_DecodeFile(const char *path, unsigned long long maxMemory)
+{
+  CLzmaSpecResult *result = NewResult(maxMemory);
+  if (!result)
+    return NULL;
+  CInputStream inStream;
+  inStream.File = fopen(path, "rb");
+  inStream.Init();
+  if (inStream.File == 0)
+  {
+    result->Error = "Can't open input file";
+    return result;
+  }
+  result->Decode(inStream);
+  fclose(inStream.File);
+  return result;
+}
+
+CLzmaSpecResult *LzmaSpec_DecodeBuffer(const void *data, size_t size, unsigned long long maxMemory)
+{
+  CLzmaSpecResult *result = NewResult(maxMemory);
+  if (!result)
+    return NULL;
+  CInputStream inStream;
+  inStream.Buf = (const Byte *)data;
+  inStream.Size = size;
+  inStream.Init();
+  result->Decode(inStream);
+  return result;
+}
+
+void LzmaSpec_Free(CLzmaSpecResult *result)
+{
+  delete result;
+}
+
+const char *LzmaSpec_GetError(const CLzmaSpecResult *result)
+{
+  return result->Error;
+}
+
+int LzmaSpec_IsCorrupted(const CLzmaSpecResult *result)
+{
+  return result->Decoder.RangeDec.Corrupted;
+}
+
+size_t LzmaSpec_GetSize(const CLzmaSpecResult *result)
+{
+  return result->Decoder.Perplexities.size();
+}
+
+const unsigned char *LzmaSpec_GetOutput(const CLzmaSpecResult *result)
+{
+  return result->Decoder.OutWindow.OutStream.Data.data();
+}
+
+const float *LzmaSpec_GetCosts(const CLzmaSpecResult *result)
+{
+  return result->Decoder.Perplexities.data();
+}
+
+const unsigned char *LzmaSpec_GetLiterals(const CLzmaSpecResult *result)
+{
+  return result->Decoder.Literals.data();
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+// Baseline entropy estimates to compare the LZMA cost against.
+//
+// Adaptive order-0 and order-1 byte models over a sliding window of the
+// decoded output, using the add-1/2 (Krichevsky-Trofimov) estimator. Each
+// byte is costed before it is counted, so the models see exactly what the
+// decoder has seen. Counts are kept incrementally and logarithms come from a
+// table, so adding a byte is O(1).
+//
+// The baseline LZMA is compared against is a mixture of the two models,
+// weighted by their exponentially decayed past cost. The weights only depend
+// on earlier bytes, so its total is the length of a real code, unlike taking
+// the cheaper model for every byte after the fact, and it follows whichever
+// model currently does better.
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#define kBaselineWindow (1 << 16)  // power of two
+// Factor the past cost of each model is multiplied by per byte.
+#define kBaselineMixDecay 0.998
+
+class CBaselineModel
+{
+  std::vector<float> Log2;  // Log2[i] == log2(i)
+  std::vector<unsigned char> Window;
+  uint32_t Pos;
+  uint64_t Count;
+  unsigned char Prev;       // byte before the next one to be added
+  unsigned char EvictPrev;  // byte before the next one to leave the window
+  std::vector<uint32_t> Order0;       // [byte]
+  std::vector<uint32_t> Order1;       // [prev * 256 + byte]
+  std::vector<uint32_t> Order1Total;  // [prev]
+  double Order0Past, Order1Past;      // decayed cost in bits
+
+public:
+  // Cost in bits of every byte under each model.
+  std::vector<float> Order0Cost;
+  std::vector<float> Order1Cost;
+  std::vector<float> MixCost;
+
+  // Bytes of fixed state, on top of 12 bytes per added byte.
+  static uint64_t FixedMemory()
+  {
+    return (2 * kBaselineWindow + 257) * sizeof(float) + kBaselineWindow
+        + (256 + 256 * 256 + 256) * sizeof(uint32_t);
+  }
+
+  CBaselineModel():
+      Log2(2 * kBaselineWindow + 257), Window(kBaselineWindow), Pos(0), Count(0),
+      Prev(0), EvictPrev(0), Order0(256), Order1(256 * 256), Order1Total(256),
+      Order0Past(0), Order1Past(0)
+  {
+    for (size_t i = 1; i < Log2.size(); i++)
+      Log2[i] = log2f((float)i);
+  }
+
+  void Add(unsigned char b)
+  {
+    uint32_t total = Count < kBaselineWindow ? (uint32_t)Count : kBaselineWindow;
+    float cost0 = Log2[2 * total + 256] - Log2[2 * Order0[b] + 1];
+    float cost1 = Log2[2 * Order1Total[Prev] + 256] - Log2[2 * Order1[Prev * 256 + b] + 1];
+    Order0Cost.push_back(cost0);
+    Order1Cost.push_back(cost1);
+
+    // -log2 of (2^-(past0 + cost0) + 2^-(past1 + cost1)) / (2^-past0 + 2^-past1)
+    double after0 = Order0Past + cost0, after1 = Order1Past + cost1;
+    MixCost.push_back((float)(SumCost(after0, after1) - SumCost(Order0Past, Order1Past)));
+    Order0Past = after0 * kBaselineMixDecay;
+    Order1Past = after1 * kBaselineMixDecay;
+
+    if (Count >= kBaselineWindow)
+    {
+      unsigned char old = Window[Pos];
+      Order0[old]--;
+      Order1[EvictPrev * 256 + old]--;
+      Order1Total[EvictPrev]--;
+      EvictPrev = old;
+    }
+    Window[Pos] = b;
+    Pos = (Pos + 1) & (kBaselineWindow - 1);
+    Order0[b]++;
+    Order1[Prev * 256 + b]++;
+    Order1Total[Prev]++;
+    Prev = b;
+    Count++;
+  }
+
+private:
+  // -log2(2^-a + 2^-b)
+  static double SumCost(double a, double b)
+  {
+    return std::min(a, b) - log2(1 + exp2(-fabs(a - b)));
+  }
+};
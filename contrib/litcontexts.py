@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+
+import sys, argparse, math
+from typing import *
+
+# Estimates how the literal cost would change with other lc/lp settings,
+# from the statistics written by `LzmaSpec --lit-stats`. Each setting is
+# scored with the cost of an adaptive (Krichevsky-Trofimov) byte model per
+# literal context, which only depends on the counts. The scores ignore match
+# bytes and LZMA's binary coding, so compare them with each other rather
+# than with the measured cost.
+
+LOG2 = math.log(2)
+
+def ktcost(counts: Sequence[int]) -> float:
+    """Bits to code these symbol counts with an adaptive add-1/2 model over 256 symbols."""
+    n = sum(counts)
+    bits = math.lgamma(n + 128) - math.lgamma(128)
+    for c in counts:
+        if c:
+            bits -= math.lgamma(c + 0.5) - math.lgamma(0.5)
+    return bits / LOG2
+
+def readstats(path: str):
+    contexts, pairs, pos = {}, {}, {}
+    with open(path, 'r') as f:
+        magic, version, lc, lp = f.readline().split()
+        if magic != 'lzma-litstats' or version != '1':
+            raise ValueError("%s: not an LzmaSpec --lit-stats file" % path)
+        for line in f:
+            x = line.split()
+            if x[0] == 'c':
+                contexts[int(x[1])] = (int(x[2]), int(x[3]), float(x[4]))
+            elif x[0] == 'p':
+                pairs[(int(x[1]), int(x[2]))] = int(x[3])
+            elif x[0] == 'q':
+                pos[(int(x[1]), int(x[2]))] = int(x[3])
+    return int(lc), int(lp), contexts, pairs, pos
+
+def grouped(counts: Dict[Tuple[int, int], int], key) -> float:
+    groups = {}
+    for (ctx, byte), n in counts.items():
+        groups.setdefault(key(ctx), [0]*256)[byte] += n
+    return sum(ktcost(g) for g in groups.values())
+
+def main(opts):
+    lc, lp, contexts, pairs, pos = readstats(opts.stats_file)
+    count = sum(c[0] for c in contexts.values())
+    matched = sum(c[1] for c in contexts.values())
+    bits = sum(c[2] for c in contexts.values())
+    print("lc=%d lp=%d: %d literals (%d matched), %.2f bits, %.3f bits/literal" % \
+          (lc, lp, count, matched, bits, bits / max(count, 1)))
+
+    print("\n%-10s %14s %10s" % ("Setting", "Est. bits", "Change"))
+    print("-" * 36)
+    ref = grouped(pairs, lambda prev: prev >> (8 - lc))
+    for l in range(9):
+        est = grouped(pairs, lambda prev: prev >> (8 - l))
+        print("%-10s %14.2f %+9.2f%%%s" % ("lc=%d lp=0" % l, est, 100 * (est / ref - 1),
+              " *" if l == lc else ""))
+    ref = grouped(pos, lambda p: 0)
+    for l in range(5):
+        est = grouped(pos, lambda p: p & ((1 << l) - 1))
+        print("%-10s %14.2f %+9.2f%%%s" % ("lc=0 lp=%d" % l, est, 100 * (est / ref - 1),
+              " *" if l == lp else ""))
+
+if __name__ == '__main__':
+    p = argparse.ArgumentParser(description="Estimates the literal cost of other lc/lp settings "+\
+        "from the output of `LzmaSpec --lit-stats`. Changes are relative to the current lc "+\
+        "(with lp=0) and to lp=0 (with lc=0) respectively.")
+    p.add_argument("stats_file", type=str, help="The file written by LzmaSpec --lit-stats")
+    exit(main(p.parse_args()) or 0)
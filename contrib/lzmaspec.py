@@ -0,0 +1,155 @@
+
+import ctypes, os, socket, json
+from typing import *
+
+# Thin ctypes binding of libLzmaSpec (see LzmaSpec.h). The arrays returned by
+# Analysis are memoryviews of the library's own buffers, nothing is copied.
+# Client talks to a running `LzmaSpec --serve` instead (see lzmaserver.hpp).
+
+API_VERSION = 1
+
+class Error(Exception): pass
+
+def load(path: Optional[str] = None) -> ctypes.CDLL:
+    if path is None:
+        path = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                            '..', 'libLzmaSpec.so')
+    lib = ctypes.CDLL(path)
+
+    lib.LzmaSpec_ApiVersion.restype = ctypes.c_int
+    lib.LzmaSpec_DecodeFile.restype = ctypes.c_void_p
+    lib.LzmaSpec_DecodeFile.argtypes = [ctypes.c_char_p, ctypes.c_ulonglong]
+    lib.LzmaSpec_DecodeBuffer.restype = ctypes.c_void_p
+    lib.LzmaSpec_DecodeBuffer.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_ulonglong]
+    lib.LzmaSpec_Free.restype = None
+    lib.LzmaSpec_Free.argtypes = [ctypes.c_void_p]
+    lib.LzmaSpec_GetError.restype = ctypes.c_char_p
+    lib.LzmaSpec_GetError.argtypes = [ctypes.c_void_p]
+    lib.LzmaSpec_IsCorrupted.restype = ctypes.c_int
+    lib.LzmaSpec_IsCorrupted.argtypes = [ctypes.c_void_p]
+    lib.LzmaSpec_GetSize.restype = ctypes.c_size_t
+    lib.LzmaSpec_GetSize.argtypes = [ctypes.c_void_p]
+    for f in (lib.LzmaSpec_GetOutput, lib.LzmaSpec_GetCosts, lib.LzmaSpec_GetLiterals):
+        f.restype = ctypes.c_void_p
+        f.argtypes = [ctypes.c_void_p]
+
+    if lib.LzmaSpec_ApiVersion() < API_VERSION:
+        raise Error("%s is too old (API version %d, need %d)" % \
+                    (path, lib.LzmaSpec_ApiVersion(), API_VERSION))
+    return lib
+
+class _Result:
+    """Owns a native result. Shared by an Analysis and the arrays behind its
+    views, so it is only freed once the last of them goes away."""
+
+    def __init__(self, lib: ctypes.CDLL, handle: int):
+        self.lib = lib
+        self.handle = handle
+
+    def __del__(self):
+        if self.handle:
+            self.lib.LzmaSpec_Free(self.handle)
+            self.handle = None
+
+class Analysis:
+    """Decoded .lzma stream. Use decode_file() or decode_buffer()."""
+
+    def __init__(self, lib: ctypes.CDLL, handle: int):
+        self._lib = lib
+        if not handle:
+            raise MemoryError()
+        self._result = _Result(lib, handle)
+        err = lib.LzmaSpec_GetError(handle)
+        if err is not None:
+            self.close()
+            raise Error(err.decode('utf-8'))
+        self.size = lib.LzmaSpec_GetSize(handle)
+        self.corrupted = lib.LzmaSpec_IsCorrupted(handle) != 0
+
+    def close(self):
+        """Releases the result; views obtained before stay valid."""
+        self._result = None
+
+    def __enter__(self): return self
+    def __exit__(self, *exc): self.close()
+
+    @property
+    def _handle(self) -> int:
+        if self._result is None:
+            raise Error("Analysis is closed")
+        return self._result.handle
+
+    def _view(self, ptr: int, ctype, fmt: str) -> memoryview:
+        if self.size == 0:
+            return memoryview(b'').cast(fmt)
+        arr = (ctype * self.size).from_address(ptr)
+        arr._owner = self._result # keeps the native buffer alive with the view
+        return memoryview(arr).cast('B').cast(fmt)
+
+    def output(self) -> memoryview:
+        """The decompressed data."""
+        return self._view(self._lib.LzmaSpec_GetOutput(self._handle), ctypes.c_ubyte, 'B')
+
+    def costs(self) -> memoryview:
+        """Cost of every decompressed byte, in bits."""
+        return self._view(self._lib.LzmaSpec_GetCosts(self._handle), ctypes.c_float, 'f')
+
+    def literals(self) -> memoryview:
+        """1 for every byte coded as a literal, 0 for bytes copied by matches."""
+        return self._view(self._lib.LzmaSpec_GetLiterals(self._handle), ctypes.c_ubyte, 'B')
+
+def decode_file(lib: ctypes.CDLL, path: str, max_memory: int = 0) -> Analysis:
+    return Analysis(lib, lib.LzmaSpec_DecodeFile(path.encode(), max_memory))
+
+def decode_buffer(lib: ctypes.CDLL, data: bytes, max_memory: int = 0) -> Analysis:
+    return Analysis(lib, lib.LzmaSpec_DecodeBuffer(data, len(data), max_memory))
+
+class Client:
+    """Connection to `LzmaSpec --serve`. The source of every request is
+    either a path (str), read by the server, or the .lzma data (bytes)."""
+
+    def __init__(self, path: str):
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._sock.connect(path)
+        self._file = self._sock.makefile('rwb')
+
+    def close(self):
+        self._file.close()
+        self._sock.close()
+
+    def __enter__(self): return self
+    def __exit__(self, *exc): self.close()
+
+    def _request(self, command: str, source: Union[str, bytes, None], extra: bytes = b'') -> bytes:
+        if source is None:
+            self._file.write(("%s\n" % command).encode())
+        elif isinstance(source, str):
+            # the server doesn't share our working directory
+            self._file.write(("%s file %s\n" % (command, os.path.abspath(source))).encode() + extra)
+        else:
+            self._file.write(("%s buffer %d\n" % (command, len(source))).encode() + extra + source)
+        self._file.flush()
+        status = self._file.readline().decode('utf-8').rstrip('\n')
+        if status.startswith('error '):
+            raise Error(status[6:])
+        if not status.startswith('ok '):
+            raise Error("Bad reply from server: %r" % status)
+        return self._file.read(int(status[3:]))
+
+    def costs(self, source: Union[str, bytes]) -> List[float]:
+        """Cost of every byte normalised to the most expensive one, as --raw prints them."""
+        return [float(x) for x in self._request('costs', source).split()]
+
+    def summary(self, source: Union[str, bytes]) -> Dict[str, Any]:
+        return json.loads(self._request('summary', source))
+
+    def ranges(self, source: Union[str, bytes], ranges: Sequence[Tuple[int, int]]) -> List[Tuple[float, float]]:
+        """Bits and normalised cost of each (offset, size) range of the output."""
+        spec = (' '.join("%d %d" % r for r in ranges) + '\n').encode()
+        reply = self._request('ranges', source, spec).decode('utf-8')
+        return [tuple(float(x) for x in l.split()) for l in reply.splitlines()]
+
+    def stats(self) -> Dict[str, int]:
+        """Cache counters of the server."""
+        return json.loads(self._request('stats', None))
+
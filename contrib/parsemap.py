@@ -3,7 +3,7 @@
 import sys, subprocess, argparse, lzma
 from typing import *
 
-import linkmap, hackyelf
+import linkmap, hackyelf, lzmaspec
 from linkmap import MMap, LinkMap
 from hackyelf import ELF, Phdr, Dyn
 
@@ -80,16 +80,41 @@ def splitr(s):
     i = s.index('=')
     return s[:i], s[i+1:]
 
+def getweights(opts) -> Tuple[Sequence[float], bytes]:
+    if opts.server is not None:
+        with lzmaspec.Client(opts.server) as c:
+            weights = c.costs(opts.lzma_file)
+        with lzma.open(opts.lzma_file, 'rb') as lf: elfb = lf.read()
+        return weights, elfb
+
+    # an explicitly given binary wins over the library next to contrib/
+    lib = None
+    if opts.lib is not None or opts.lzmaspec is None:
+        try:
+            lib = lzmaspec.load(opts.lib)
+        except (OSError, AttributeError, lzmaspec.Error):
+            lib = None # missing, lacking symbols or too old
+
+    # fall back to running LzmaSpec and decompressing the file a second time
+    if lib is None:
+        weights = [float(x.strip()) for x in \
+                   subprocess.check_output([opts.lzmaspec or "./LzmaSpec", "--raw", opts.lzma_file]) \
+                        .decode('utf-8').split('\n') \
+                   if len(x) > 0]
+
+        elfb = None
+        with lzma.open(opts.lzma_file, 'rb') as lf: elfb = lf.read()
+        return weights, elfb
+
+    with lzmaspec.decode_file(lib, opts.lzma_file) as a:
+        costs = a.costs()
+        maxc = max(costs) if len(costs) > 0 else 1.0
+        return [c / maxc for c in costs], a.output().tobytes()
+
 def main(opts):
     recs = dict([splitr(s) for s in (opts.recurse or [])])
 
-    weights = [float(x.strip()) for x in \
-               subprocess.check_output([opts.lzmaspec, "--raw", opts.lzma_file]) \
-                    .decode('utf-8').split('\n') \
-               if len(x) > 0]
-
-    elfb = None
-    with lzma.open(opts.lzma_file, 'rb') as lf: elfb = lf.read()
+    weights, elfb = getweights(opts)
 
     maps = opts.map_file.read()
     elf  = hackyelf.parse(elfb)
@@ -127,8 +152,16 @@ map file. (`ld -Map', `cc -Wl,-Map', see respective manpages.)
     p.add_argument("--recurse", action='append', help="Recursively analyse "+\
                    "data in symbols. Syntax: --recurse symname=linker.map")
 
-    p.add_argument("--lzmaspec", type=str, default="./LzmaSpec", \
-                   help="LzmaSpec binary to use (default: ./LzmaSpec)")
+    p.add_argument("--lzmaspec", type=str, default=None, \
+                   help="LzmaSpec binary to use if libLzmaSpec.so isn't "+\
+                   "used (default: ./LzmaSpec)")
+    p.add_argument("--lib", type=str, default=None, \
+                   help="libLzmaSpec.so to analyse the file in-process with, "+\
+                   "instead of running LzmaSpec (default: next to contrib/, "+\
+                   "unless --lzmaspec is given)")
+    p.add_argument("--server", type=str, default=None, \
+                   help="Socket of a running `LzmaSpec --serve' to get the "+\
+                   "costs from instead")
 
     exit(main(p.parse_args(sys.argv[1:])))
 
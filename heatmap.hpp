@@ -0,0 +1,120 @@
+#pragma once
+
+// Quantisation of the per-byte cost into heat levels, shared by all renderers.
+//
+// A byte's heat is sqrt(cost / maxCost), stored as a level in 0..kHeatMax so
+// that renderers can index precomputed tables instead of redoing the float
+// maths per byte. The per-byte loops are branch-free and work on restrict
+// pointers so that GCC vectorises them with -ftree-loop-vectorize (see the
+// Makefile); the maximum is kept in kHeatLanes independent partial maxima,
+// since a single running maximum of floats is a reduction GCC won't reorder.
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#define kHeatMax 255
+// In relative mode, the ratio of cost to baseline shown as the hottest level.
+#define kHeatRelativeMax 2.f
+#define kHeatLanes 8
+
+class CHeatMap
+{
+public:
+  float MaxCost;
+  std::vector<uint8_t> Levels;
+
+  // Min, average and max level of every full row of RowWidth bytes.
+  unsigned RowWidth;
+  std::vector<uint8_t> RowMin;
+  std::vector<uint8_t> RowAvg;
+  std::vector<uint8_t> RowMax;
+
+  // Bytes needed for n bytes of cost.
+  static uint64_t Memory(uint64_t n, unsigned rowWidth)
+  {
+    return n + 3 * (n / rowWidth);
+  }
+
+  void Compute(const std::vector<float> &cost, unsigned rowWidth)
+  {
+    size_t n = cost.size();
+    MaxCost = Max(cost.data(), n);
+    float scale = MaxCost > 0 ? 1.f / MaxCost : 0;
+    Levels.resize(n);
+    Quantise(cost.data(), scale, Levels.data(), n);
+    ComputeRows(rowWidth);
+  }
+
+  // Heat as the ratio of cost to a baseline cost on a linear scale, so that
+  // the middle of the gradient means "as expensive as the baseline". Leaves
+  // MaxCost alone.
+  void ComputeRelative(const std::vector<float> &cost, const std::vector<float> &baseline, unsigned rowWidth)
+  {
+    size_t n = cost.size();
+    Levels.resize(n);
+    QuantiseRelative(cost.data(), baseline.data(), Levels.data(), n);
+    ComputeRows(rowWidth);
+  }
+
+private:
+  static float Max(const float *__restrict c, size_t n)
+  {
+    float lane[kHeatLanes] = {};
+    size_t i = 0;
+    for (; i + kHeatLanes <= n; i += kHeatLanes)
+      for (unsigned k = 0; k < kHeatLanes; k++)
+        lane[k] = c[i + k] > lane[k] ? c[i + k] : lane[k];
+    for (; i < n; i++)
+      lane[0] = c[i] > lane[0] ? c[i] : lane[0];
+    float max = 0;
+    for (unsigned k = 0; k < kHeatLanes; k++)
+      max = std::max(max, lane[k]);
+    return max;
+  }
+
+  static void Quantise(const float *__restrict c, float scale, uint8_t *__restrict levels, size_t n)
+  {
+    for (size_t i = 0; i < n; i++)
+    {
+      float heat = sqrtf(c[i] * scale) * kHeatMax + 0.5f;
+      levels[i] = (uint8_t)std::min(heat, (float)kHeatMax);
+    }
+  }
+
+  static void QuantiseRelative(const float *__restrict c, const float *__restrict b,
+      uint8_t *__restrict levels, size_t n)
+  {
+    for (size_t i = 0; i < n; i++)
+    {
+      float heat = c[i] / b[i] * (kHeatMax / kHeatRelativeMax) + 0.5f;
+      levels[i] = (uint8_t)std::min(heat, (float)kHeatMax);
+    }
+  }
+
+  void ComputeRows(unsigned rowWidth)
+  {
+    size_t n = Levels.size();
+    const uint8_t *levels = Levels.data();
+    RowWidth = rowWidth;
+    size_t rows = n / rowWidth;
+    RowMin.resize(rows);
+    RowAvg.resize(rows);
+    RowMax.resize(rows);
+    for (size_t r = 0; r < rows; r++)
+    {
+      const uint8_t *row = levels + r * rowWidth;
+      unsigned lo = kHeatMax, hi = 0, sum = 0;
+      for (unsigned i = 0; i < rowWidth; i++)
+      {
+        lo = std::min(lo, (unsigned)row[i]);
+        hi = std::max(hi, (unsigned)row[i]);
+        sum += row[i];
+      }
+      RowMin[r] = (uint8_t)lo;
+      RowAvg[r] = (uint8_t)((sum + rowWidth / 2) / rowWidth);
+      RowMax[r] = (uint8_t)hi;
+    }
+  }
+};
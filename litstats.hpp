@@ -0,0 +1,88 @@
+#pragma once
+
+// Literal statistics for lc/lp tuning, collected while decoding.
+//
+// For every literal context (litState, see CLzmaDecoder::DecodeLiteral) the
+// number of literals, how many of them were coded against a match byte and
+// their cost in bits. Independently of lc and lp, the count and cost of
+// every (previous byte, byte) pair and the count of every byte at each
+// position modulo 16, from which the cost of other settings can be
+// estimated without re-encoding (see contrib/litcontexts.py).
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#define kLitStatsNumPos 16  // 1 << the largest lp
+
+struct CLitContextStats
+{
+  uint64_t Count;
+  uint64_t Matched;
+  double Bits;
+};
+
+struct CLitPairStats
+{
+  uint64_t Count;
+  double Bits;
+};
+
+class CLiteralStats
+{
+public:
+  unsigned lc, lp;
+  std::vector<CLitContextStats> Contexts;  // [litState]
+  std::vector<CLitPairStats> Pairs;        // [prevByte * 256 + byte]
+  std::vector<uint64_t> PosCounts;         // [pos % kLitStatsNumPos * 256 + byte]
+
+  static uint64_t Memory(unsigned lc, unsigned lp)
+  {
+    return ((uint64_t)1 << (lc + lp)) * sizeof(CLitContextStats)
+        + 256 * 256 * sizeof(CLitPairStats) + kLitStatsNumPos * 256 * sizeof(uint64_t);
+  }
+
+  void Create(unsigned lc_, unsigned lp_)
+  {
+    lc = lc_;
+    lp = lp_;
+    Contexts.assign((size_t)1 << (lc + lp), CLitContextStats());
+    Pairs.assign(256 * 256, CLitPairStats());
+    PosCounts.assign(kLitStatsNumPos * 256, 0);
+  }
+
+  void Add(unsigned litState, unsigned pos, unsigned prevByte, unsigned byte, bool matched, float bits)
+  {
+    CLitContextStats &c = Contexts[litState];
+    c.Count++;
+    c.Matched += matched;
+    c.Bits += bits;
+    CLitPairStats &p = Pairs[prevByte * 256 + byte];
+    p.Count++;
+    p.Bits += bits;
+    PosCounts[(pos % kLitStatsNumPos) * 256 + byte]++;
+  }
+
+  // Writes the non-zero entries as text, one per line:
+  //   lzma-litstats 1 <lc> <lp>
+  //   c <litState> <count> <matched> <bits>
+  //   p <prevByte> <byte> <count> <bits>
+  //   q <pos % 16> <byte> <count>
+  bool Write(FILE *f) const
+  {
+    fprintf(f, "lzma-litstats 1 %u %u\n", lc, lp);
+    for (size_t i = 0; i < Contexts.size(); i++)
+      if (Contexts[i].Count)
+        fprintf(f, "c %u %llu %llu %.2f\n", (unsigned)i, (unsigned long long)Contexts[i].Count,
+            (unsigned long long)Contexts[i].Matched, Contexts[i].Bits);
+    for (size_t i = 0; i < Pairs.size(); i++)
+      if (Pairs[i].Count)
+        fprintf(f, "p %u %u %llu %.2f\n", (unsigned)(i >> 8), (unsigned)(i & 0xFF),
+            (unsigned long long)Pairs[i].Count, Pairs[i].Bits);
+    for (size_t i = 0; i < PosCounts.size(); i++)
+      if (PosCounts[i])
+        fprintf(f, "q %u %u %llu\n", (unsigned)(i >> 8), (unsigned)(i & 0xFF),
+            (unsigned long long)PosCounts[i]);
+    return ferror(f) == 0;
+  }
+};
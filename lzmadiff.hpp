@@ -0,0 +1,199 @@
+#pragma once
+
+// Content-aligned comparison of the per-byte cost of two decoded streams.
+//
+// Offsets shift between two builds of the same program, so the costs can't be
+// compared by position. Instead the new stream is matched against the old one
+// using content-defined anchors (windows whose rolling hash has its top bits
+// clear), every anchor hit is extended byte-by-byte in both directions, and
+// whatever is left over is reported as inserted (new only) or deleted (old
+// only) content. Everything is linear in the size of the inputs.
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+namespace lzmadiff
+{
+  enum RegionKind
+  {
+    kAligned,
+    kInserted,
+    kDeleted
+  };
+
+  struct Region
+  {
+    RegionKind Kind;
+    uint64_t OldPos;  // unused for kInserted
+    uint64_t NewPos;  // unused for kDeleted
+    uint64_t Size;
+    double OldCost;   // bits spent on this content in the old stream
+    double NewCost;   // bits spent on this content in the new stream
+  };
+
+  #define kDiffWindow 32
+  #define kDiffAnchorShift 58  // one anchor per 64 bytes on average
+  #define kDiffHashBase 0x100000001B3ull
+
+  class CRollingHash
+  {
+    uint64_t OutFactor;  // kDiffHashBase ^ (kDiffWindow - 1)
+
+  public:
+    uint64_t Value;
+
+    CRollingHash()
+    {
+      OutFactor = 1;
+      for (unsigned i = 1; i < kDiffWindow; i++)
+        OutFactor *= kDiffHashBase;
+    }
+
+    void Init(const unsigned char *p)
+    {
+      Value = 0;
+      for (unsigned i = 0; i < kDiffWindow; i++)
+        Value = Value * kDiffHashBase + p[i];
+    }
+
+    void Roll(unsigned char out, unsigned char in)
+    {
+      Value = (Value - out * OutFactor) * kDiffHashBase + in;
+    }
+
+    bool IsAnchor() const { return (Value >> kDiffAnchorShift) == 0; }
+  };
+
+  inline double SumCost(const std::vector<float> &cost, uint64_t pos, uint64_t size)
+  {
+    double sum = 0;
+    for (uint64_t i = pos; i < pos + size; i++)
+      sum += cost[i];
+    return sum;
+  }
+
+  // Bytes Align needs for the anchor table and coverage map of an old stream
+  // of oldSize bytes, not counting the regions returned.
+  inline uint64_t AlignMemory(uint64_t oldSize)
+  {
+    // One anchor per 64 bytes on average, at about 48 bytes per table entry.
+    return (oldSize >> (64 - kDiffAnchorShift)) * 48 + oldSize / 8;
+  }
+
+  // Aligned regions longer than blockSize are split so that the cost change
+  // of a large unchanged stretch is still reported close to where it happens.
+  inline std::vector<Region> Align(
+      const std::vector<unsigned char> &oldData, const std::vector<float> &oldCost,
+      const std::vector<unsigned char> &newData, const std::vector<float> &newCost,
+      uint64_t blockSize)
+  {
+    std::vector<Region> regions;
+    uint64_t m = oldData.size();
+    uint64_t n = newData.size();
+    const unsigned char *o = oldData.data();
+    const unsigned char *p = newData.data();
+
+    // Repeated windows (zero padding, tables) keep their first occurrence.
+    std::unordered_map<uint64_t, uint64_t> anchors;
+    CRollingHash hash;
+    if (m >= kDiffWindow)
+    {
+      hash.Init(o);
+      for (uint64_t i = 0;; i++)
+      {
+        if (hash.IsAnchor())
+          anchors.insert(std::make_pair(hash.Value, i));
+        if (i + kDiffWindow >= m)
+          break;
+        hash.Roll(o[i], o[i + kDiffWindow]);
+      }
+    }
+
+    std::vector<bool> oldCovered(m, false);
+    uint64_t newDone = 0;
+    int64_t diagonal = 0;  // old position minus new position of the last match
+    uint64_t q = 0;
+    if (n >= kDiffWindow)
+      hash.Init(p);
+    while (q + kDiffWindow <= n)
+    {
+      if (hash.IsAnchor())
+      {
+        // Prefer continuing on the same diagonal, which is what an in-place
+        // edit looks like, before falling back to the anchor table.
+        int64_t cand = (int64_t)q + diagonal;
+        bool found = cand >= 0 && (uint64_t)cand + kDiffWindow <= m
+            && !memcmp(o + cand, p + q, kDiffWindow);
+        if (!found)
+        {
+          std::unordered_map<uint64_t, uint64_t>::const_iterator it = anchors.find(hash.Value);
+          if (it != anchors.end() && !memcmp(o + it->second, p + q, kDiffWindow))
+          {
+            cand = (int64_t)it->second;
+            found = true;
+          }
+        }
+        if (found)
+        {
+          uint64_t op = (uint64_t)cand;
+          uint64_t back = 0;
+          while (q - back > newDone && op - back > 0 && o[op - back - 1] == p[q - back - 1])
+            back++;
+          uint64_t fwd = kDiffWindow;
+          while (op + fwd < m && q + fwd < n && o[op + fwd] == p[q + fwd])
+            fwd++;
+
+          if (q - back > newDone)
+          {
+            Region r = { kInserted, 0, newDone, q - back - newDone, 0,
+                SumCost(newCost, newDone, q - back - newDone) };
+            regions.push_back(r);
+          }
+          for (uint64_t start = 0; start < back + fwd; start += blockSize)
+          {
+            uint64_t size = std::min(blockSize, back + fwd - start);
+            Region r = { kAligned, op - back + start, q - back + start, size,
+                SumCost(oldCost, op - back + start, size),
+                SumCost(newCost, q - back + start, size) };
+            regions.push_back(r);
+          }
+          std::fill(oldCovered.begin() + (op - back), oldCovered.begin() + (op + fwd), true);
+
+          newDone = q + fwd;
+          diagonal = (int64_t)op - (int64_t)q;
+          q = newDone;
+          if (q + kDiffWindow <= n)
+            hash.Init(p + q);
+          continue;
+        }
+      }
+      if (q + kDiffWindow < n)
+        hash.Roll(p[q], p[q + kDiffWindow]);
+      q++;
+    }
+    if (newDone < n)
+    {
+      Region r = { kInserted, 0, newDone, n - newDone, 0,
+          SumCost(newCost, newDone, n - newDone) };
+      regions.push_back(r);
+    }
+
+    for (uint64_t i = 0; i < m;)
+    {
+      if (oldCovered[i])
+      {
+        i++;
+        continue;
+      }
+      uint64_t start = i;
+      while (i < m && !oldCovered[i])
+        i++;
+      Region r = { kDeleted, start, 0, i - start, SumCost(oldCost, start, i - start), 0 };
+      regions.push_back(r);
+    }
+    return regions;
+  }
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+// Finds .lzma streams embedded at unknown offsets in a larger file.
+//
+// Every offset is first run through a cheap filter on the 13-byte header and
+// the first range coder byte (vectorised with SSE2 where available). The few
+// candidates that pass a stricter header check are then trial-decoded by a
+// pool of threads, giving up on the first sign of corruption.
+
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <new>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "LzmaDec.hpp"
+
+namespace lzmascan
+{
+  struct Stream
+  {
+    uint64_t Offset;
+    uint64_t PackSize;    // including the header
+    uint64_t UnpackSize;
+    unsigned lc, lp, pb;
+    UInt32 DictSize;
+    double Cost;          // total bits
+  };
+
+  #define kScanHeaderSize 13
+  // Bytes needed from a candidate offset: header plus the first range coder byte.
+  #define kScanPrefixSize (kScanHeaderSize + 1)
+  // LZMA can't do much better than this, so larger declared sizes are bogus.
+  #define kScanMaxRatio 8192
+
+  // Encoders round the dictionary size up to 2^n or 2^n + 2^(n-1).
+  inline bool IsSaneDictSize(UInt32 d)
+  {
+    if (d < (1 << 12) || d > (3u << 29))
+      return false;
+    while (!(d & 1))
+      d >>= 1;
+    return d == 1 || d == 3;
+  }
+
+  inline bool CheckHeader(const Byte *p, uint64_t avail)
+  {
+    if (avail < kScanPrefixSize || p[0] >= 9 * 5 * 5 || p[kScanHeaderSize] != 0)
+      return false;
+    UInt32 dictSize = 0;
+    for (int i = 0; i < 4; i++)
+      dictSize |= (UInt32)p[1 + i] << (8 * i);
+    if (!IsSaneDictSize(dictSize))
+      return false;
+    UInt64 unpackSize = 0;
+    bool unpackSizeDefined = false;
+    for (int i = 0; i < 8; i++)
+    {
+      if (p[5 + i] != 0xFF)
+        unpackSizeDefined = true;
+      unpackSize |= (UInt64)p[5 + i] << (8 * i);
+    }
+    return !unpackSizeDefined || (unpackSize != 0 && unpackSize / kScanMaxRatio <= avail);
+  }
+
+  // A sane dictionary size always has a zero low byte, so the filter only
+  // needs three byte compares per offset.
+  inline void FindCandidates(const Byte *data, uint64_t size, std::vector<uint64_t> &candidates)
+  {
+    if (size < kScanPrefixSize)
+      return;
+    uint64_t end = size - kScanPrefixSize + 1;
+    uint64_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i maxProps = _mm_set1_epi8((char)(9 * 5 * 5 - 1));
+    for (; i + 16 <= end; i += 16)
+    {
+      __m128i props = _mm_loadu_si128((const __m128i *)(data + i));
+      __m128i dict0 = _mm_loadu_si128((const __m128i *)(data + i + 1));
+      __m128i rc0 = _mm_loadu_si128((const __m128i *)(data + i + kScanHeaderSize));
+      __m128i ok = _mm_and_si128(
+          _mm_cmpeq_epi8(_mm_min_epu8(props, maxProps), props),
+          _mm_and_si128(_mm_cmpeq_epi8(dict0, zero), _mm_cmpeq_epi8(rc0, zero)));
+      unsigned mask = (unsigned)_mm_movemask_epi8(ok);
+      while (mask)
+      {
+        unsigned bit = __builtin_ctz(mask);
+        mask &= mask - 1;
+        if (CheckHeader(data + i + bit, size - i - bit))
+          candidates.push_back(i + bit);
+      }
+    }
+#endif
+    for (; i < end; i++)
+      if (data[i + 1] == 0 && CheckHeader(data + i, size - i))
+        candidates.push_back(i);
+  }
+
+  enum TrialResult { kNotStream, kStream, kNoMemory };
+
+  // The decoder's memory is charged to budget, which may be shared between
+  // threads, for as long as the trial runs.
+  inline TrialResult TrialDecode(const Byte *data, uint64_t size, uint64_t offset, CMemoryBudget &budget, Stream &stream)
+  {
+    CMemoryBudget trialBudget;
+    trialBudget.Parent = &budget;
+    CLzmaDecoder lzmaDecoder;
+    lzmaDecoder.StopOnCorruption = true;
+    CInputStream inStream;
+    inStream.Buf = data + offset;
+    inStream.Size = size - offset;
+    inStream.Init();
+    try {
+      if (LzmaDecodeStream(inStream, lzmaDecoder, trialBudget) == LZMA_RES_ERROR)
+        return kNotStream;
+    } catch (const char *e) {
+      return IsResourceError(e) ? kNoMemory : kNotStream;
+    } catch (const std::bad_alloc &) {
+      return kNoMemory;
+    }
+    if (lzmaDecoder.RangeDec.Corrupted || lzmaDecoder.Perplexities.empty())
+      return kNotStream;
+
+    stream.Offset = offset;
+    stream.PackSize = inStream.Processed;
+    stream.UnpackSize = lzmaDecoder.Perplexities.size();
+    stream.lc = lzmaDecoder.lc;
+    stream.lp = lzmaDecoder.lp;
+    stream.pb = lzmaDecoder.pb;
+    stream.DictSize = lzmaDecoder.dictSizeInProperties;
+    stream.Cost = 0;
+    for (size_t i = 0; i < lzmaDecoder.Perplexities.size(); i++)
+      stream.Cost += lzmaDecoder.Perplexities[i];
+    return kStream;
+  }
+
+  // The threads share budget. Candidates that ran out of memory are tried
+  // again one at a time once the others are done, so the result doesn't
+  // depend on the number of threads; the offsets of those that still don't
+  // fit are returned in noMemory. Streams that lie inside the compressed data
+  // of an earlier stream are dropped.
+  inline std::vector<Stream> Scan(const std::vector<Byte> &data, CMemoryBudget &budget, std::vector<uint64_t> &noMemory)
+  {
+    std::vector<uint64_t> candidates;
+    FindCandidates(data.data(), data.size(), candidates);
+
+    unsigned numThreads = std::thread::hardware_concurrency();
+    if (numThreads == 0)
+      numThreads = 1;
+    if (numThreads > candidates.size())
+      numThreads = candidates.size() ? (unsigned)candidates.size() : 1;
+
+    std::vector<Stream> found(candidates.size());
+    std::vector<Byte> results(candidates.size(), kNotStream);
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < numThreads; t++)
+      workers.push_back(std::thread([&]() {
+        for (size_t i; (i = next++) < candidates.size();)
+          results[i] = TrialDecode(data.data(), data.size(), candidates[i], budget, found[i]);
+      }));
+    for (unsigned t = 0; t < numThreads; t++)
+      workers[t].join();
+
+    std::vector<Stream> streams;
+    uint64_t coveredUntil = 0;
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+      if (candidates[i] < coveredUntil)
+        continue;
+      if (results[i] == kNoMemory)
+        results[i] = TrialDecode(data.data(), data.size(), candidates[i], budget, found[i]);
+      if (results[i] == kNoMemory)
+        noMemory.push_back(candidates[i]);
+      if (results[i] != kStream)
+        continue;
+      streams.push_back(found[i]);
+      coveredUntil = found[i].Offset + found[i].PackSize;
+    }
+    return streams;
+  }
+};
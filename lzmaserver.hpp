@@ -0,0 +1,597 @@
+#pragma once
+
+// Local analysis server for --serve.
+//
+// Listens on a Unix domain socket and answers requests about .lzma streams
+// given as a path or sent inline. Results are cached by a hash of the
+// compressed input, so asking about the same stream again, from any client
+// and under any name, doesn't decode it again. Misses are decoded by a fixed
+// pool of worker threads; concurrent requests for the same stream share one
+// decode.
+//
+// Every request is a line "<command> file <path>" or "<command> buffer <n>"
+// followed by n bytes of .lzma data, and the reply is "ok <n>" followed by n
+// bytes, or "error <message>", each on its own line. Commands:
+//   costs    the same text LzmaSpec --raw prints
+//   summary  a JSON object with the size, total and maximum cost and packets
+//   ranges   followed by a line of "<offset> <size>" pairs of output bytes;
+//            one line "<bits> <normalised cost>" per range
+// "stats" (without a source) returns a JSON object with cache counters.
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <thread>
+#include <functional>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "LzmaDec.hpp"
+#include "rawwriter.hpp"
+
+namespace lzmaserver
+{
+  // What is kept of a decoded stream.
+  struct Analysis
+  {
+    std::string Error;  // empty if decoding succeeded
+    std::vector<float> Costs;
+    float MaxCost;
+    double TotalCost;
+    bool Corrupted;
+    UInt64 PackSize;
+    UInt64 NumLiterals, NumMatches, NumReps, NumShortReps;
+
+    UInt64 Memory() const { return sizeof(Analysis) + Costs.capacity() * sizeof(float); }
+  };
+
+  typedef std::shared_ptr<const Analysis> AnalysisPtr;
+  typedef std::shared_ptr<const std::vector<Byte> > InputPtr;
+
+  // Decoding errors are part of the result; resource errors are thrown so
+  // that they aren't cached.
+  inline AnalysisPtr Analyse(const std::vector<Byte> &input, UInt64 memoryLimit)
+  {
+    std::shared_ptr<Analysis> a(new Analysis());
+    CMemoryBudget budget;
+    budget.Limit = memoryLimit;
+    CLzmaDecoder lzmaDecoder;
+    CInputStream inStream;
+    inStream.Buf = input.data();
+    inStream.Size = input.size();
+    inStream.Init();
+    try {
+      if (LzmaDecodeStream(inStream, lzmaDecoder, budget) == LZMA_RES_ERROR)
+        a->Error = "LZMA decoding error";
+    } catch (const char *e) {
+      if (IsResourceError(e))
+        throw;
+      a->Error = e;
+    }
+    if (!a->Error.empty())
+      return a;
+
+    a->Costs.assign(lzmaDecoder.Perplexities.begin(), lzmaDecoder.Perplexities.end());
+    a->MaxCost = 0;
+    for (size_t i = 0; i < a->Costs.size(); i++)
+      a->MaxCost = std::max(a->MaxCost, a->Costs[i]);
+    a->TotalCost = lzmaDecoder.TotalCost;
+    a->Corrupted = lzmaDecoder.RangeDec.Corrupted;
+    a->PackSize = inStream.Processed;
+    a->NumLiterals = lzmaDecoder.NumLiterals;
+    a->NumMatches = lzmaDecoder.NumMatches;
+    a->NumReps = lzmaDecoder.NumReps;
+    a->NumShortReps = lzmaDecoder.NumShortReps;
+    return a;
+  }
+
+  // Size and 64-bit FNV-1a hash of the compressed input.
+  struct Key
+  {
+    UInt64 Size, Hash;
+
+    bool operator<(const Key &other) const
+    {
+      return Size != other.Size ? Size < other.Size : Hash < other.Hash;
+    }
+  };
+
+  inline Key MakeKey(const std::vector<Byte> &data)
+  {
+    Key key;
+    key.Size = data.size();
+    key.Hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < data.size(); i++)
+      key.Hash = (key.Hash ^ data[i]) * 0x100000001b3ULL;
+    return key;
+  }
+
+  class WorkerPool
+  {
+    std::vector<std::thread> Threads;
+    std::deque<std::function<void()> > Jobs;
+    std::mutex Mutex;
+    std::condition_variable Cond;
+    bool Stopping;
+
+    void Run()
+    {
+      for (;;)
+      {
+        std::function<void()> job;
+        {
+          std::unique_lock<std::mutex> lock(Mutex);
+          Cond.wait(lock, [this]() { return Stopping || !Jobs.empty(); });
+          if (Jobs.empty())
+            return;
+          job.swap(Jobs.front());
+          Jobs.pop_front();
+        }
+        job();
+      }
+    }
+
+  public:
+    WorkerPool(unsigned numThreads): Stopping(false)
+    {
+      for (unsigned i = 0; i < numThreads; i++)
+        Threads.push_back(std::thread([this]() { Run(); }));
+    }
+
+    ~WorkerPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(Mutex);
+        Stopping = true;
+      }
+      Cond.notify_all();
+      for (size_t i = 0; i < Threads.size(); i++)
+        Threads[i].join();
+    }
+
+    void Submit(const std::function<void()> &job)
+    {
+      {
+        std::lock_guard<std::mutex> lock(Mutex);
+        Jobs.push_back(job);
+      }
+      Cond.notify_one();
+    }
+  };
+
+  // Results by key, least recently used first out once their total size
+  // exceeds the limit. Entries still being decoded are never evicted.
+  class Cache
+  {
+    struct Entry
+    {
+      std::shared_future<AnalysisPtr> Result;
+      bool Ready;
+      UInt64 Memory;
+      std::list<Key>::iterator Lru;
+    };
+
+    std::map<Key, Entry> Entries;
+    std::list<Key> Lru;  // most recently used first
+    std::mutex Mutex;
+    WorkerPool &Pool;
+    UInt64 Limit;
+    UInt64 DecodeLimit;
+    UInt64 Used;
+    UInt64 Hits, Misses;
+
+    void Completed(const Key &key)
+    {
+      std::lock_guard<std::mutex> lock(Mutex);
+      std::map<Key, Entry>::iterator entry = Entries.find(key);
+      try {
+        entry->second.Memory = entry->second.Result.get()->Memory();
+      } catch (...) {
+        // Failed for lack of memory rather than because of the input, so
+        // don't keep it. The waiting requests get the exception.
+        Lru.erase(entry->second.Lru);
+        Entries.erase(entry);
+        return;
+      }
+      Entry &e = entry->second;
+      e.Ready = true;
+      Used += e.Memory;
+      std::list<Key>::iterator it = Lru.end();
+      while (Used > Limit && it != Lru.begin())
+      {
+        --it;
+        std::map<Key, Entry>::iterator victim = Entries.find(*it);
+        if (!victim->second.Ready)
+          continue;
+        Used -= victim->second.Memory;
+        Entries.erase(victim);
+        it = Lru.erase(it);
+      }
+    }
+
+  public:
+    // limit is the memory for cached results, decodeLimit (0 for none) the
+    // memory each decode may use.
+    Cache(WorkerPool &pool, UInt64 limit, UInt64 decodeLimit):
+        Pool(pool), Limit(limit), DecodeLimit(decodeLimit), Used(0), Hits(0), Misses(0) {}
+
+    AnalysisPtr Get(const InputPtr &input)
+    {
+      Key key = MakeKey(*input);
+      std::shared_future<AnalysisPtr> result;
+      {
+        std::lock_guard<std::mutex> lock(Mutex);
+        std::map<Key, Entry>::iterator it = Entries.find(key);
+        if (it != Entries.end())
+        {
+          Hits++;
+          Lru.splice(Lru.begin(), Lru, it->second.Lru);
+          result = it->second.Result;
+        }
+        else
+        {
+          Misses++;
+          UInt64 decodeLimit = DecodeLimit;
+          std::shared_ptr<std::packaged_task<AnalysisPtr()> > task(
+              new std::packaged_task<AnalysisPtr()>([input, decodeLimit]() {
+                return Analyse(*input, decodeLimit);
+              }));
+          result = task->get_future().share();
+          Entry &e = Entries[key];
+          e.Result = result;
+          e.Ready = false;
+          e.Memory = 0;
+          Lru.push_front(key);
+          e.Lru = Lru.begin();
+          Pool.Submit([this, task, key]() {
+            (*task)();
+            Completed(key);
+          });
+        }
+      }
+      return result.get();
+    }
+
+    std::string Stats()
+    {
+      std::lock_guard<std::mutex> lock(Mutex);
+      char buf[256];
+      snprintf(buf, sizeof(buf), "{\"entries\": %llu, \"memory\": %llu, \"hits\": %llu, \"misses\": %llu}\n",
+          (unsigned long long)Entries.size(), (unsigned long long)Used,
+          (unsigned long long)Hits, (unsigned long long)Misses);
+      return buf;
+    }
+  };
+
+  // Buffered reads and whole writes on a connected socket.
+  class Connection
+  {
+    int Fd;
+    char Buf[1 << 16];
+    size_t Pos, End;
+
+    bool Fill()
+    {
+      ssize_t n;
+      do
+        n = recv(Fd, Buf, sizeof(Buf), 0);
+      while (n < 0 && errno == EINTR);
+      if (n <= 0)
+        return false;
+      Pos = 0;
+      End = (size_t)n;
+      return true;
+    }
+
+  public:
+    Connection(int fd): Fd(fd), Pos(0), End(0) {}
+    ~Connection() { close(Fd); }
+
+    bool ReadLine(std::string &line)
+    {
+      line.clear();
+      for (;;)
+      {
+        if (Pos == End && !Fill())
+          return false;
+        char *nl = (char *)memchr(Buf + Pos, '\n', End - Pos);
+        size_t n = (nl ? nl - Buf : End) - Pos;
+        line.append(Buf + Pos, n);
+        Pos += n;
+        if (nl)
+        {
+          Pos++;
+          return true;
+        }
+      }
+    }
+
+    bool Read(std::vector<Byte> &data, size_t size)
+    {
+      data.resize(size);
+      for (size_t done = 0; done < size; )
+      {
+        if (Pos == End && !Fill())
+          return false;
+        size_t n = std::min(size - done, End - Pos);
+        memcpy(data.data() + done, Buf + Pos, n);
+        Pos += n;
+        done += n;
+      }
+      return true;
+    }
+
+    bool Skip(UInt64 size)
+    {
+      for (UInt64 done = 0; done < size; )
+      {
+        if (Pos == End && !Fill())
+          return false;
+        size_t n = (size_t)std::min(size - done, (UInt64)(End - Pos));
+        Pos += n;
+        done += n;
+      }
+      return true;
+    }
+
+    bool Write(const std::string &data)
+    {
+      for (size_t done = 0; done < data.size(); )
+      {
+        ssize_t n = send(Fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n <= 0)
+          return false;
+        done += n;
+      }
+      return true;
+    }
+  };
+
+  class Server
+  {
+    WorkerPool Pool;
+    Cache Results;
+    UInt64 MaxInput;
+
+    // maxSize is 0 for no limit.
+    static InputPtr ReadInputFile(const std::string &path, UInt64 maxSize)
+    {
+      FILE *file = fopen(path.c_str(), "rb");
+      if (file == 0)
+        throw "Can't open input file";
+      struct stat st;
+      if (maxSize != 0 && fstat(fileno(file), &st) == 0 && (UInt64)st.st_size > maxSize)
+      {
+        fclose(file);
+        throw "Input file too large";
+      }
+      std::shared_ptr<std::vector<Byte> > data(new std::vector<Byte>);
+      Byte chunk[1 << 16];
+      size_t size;
+      // The file may grow after fstat, or not be a regular file at all.
+      while ((size = fread(chunk, 1, sizeof(chunk), file)) > 0)
+      {
+        if (maxSize != 0 && data->size() + size > maxSize)
+        {
+          fclose(file);
+          throw "Input file too large";
+        }
+        data->insert(data->end(), chunk, chunk + size);
+      }
+      bool failed = ferror(file) != 0;
+      fclose(file);
+      if (failed)
+        throw "Can't read input file";
+      return data;
+    }
+
+    static std::string Costs(const Analysis &a)
+    {
+      std::string out;
+      CRawWriter raw(6, &out);
+      double maxCost = a.MaxCost;
+      for (size_t i = 0; i < a.Costs.size(); i++)
+      {
+        raw.Number(a.Costs[i] / maxCost);
+        raw.Char('\n');
+      }
+      raw.Char('\n');
+      raw.Flush();
+      return out;
+    }
+
+    static std::string Summary(const Analysis &a)
+    {
+      char buf[512];
+      snprintf(buf, sizeof(buf), "{\"packed_size\": %llu, \"unpacked_size\": %llu, "
+          "\"total_bits\": %.2f, \"max_bits\": %.6g, \"corrupted\": %s, \"packets\": "
+          "{\"literal\": %llu, \"match\": %llu, \"rep\": %llu, \"shortrep\": %llu}}\n",
+          (unsigned long long)a.PackSize, (unsigned long long)a.Costs.size(),
+          a.TotalCost, a.MaxCost, a.Corrupted ? "true" : "false",
+          (unsigned long long)a.NumLiterals, (unsigned long long)a.NumMatches,
+          (unsigned long long)a.NumReps, (unsigned long long)a.NumShortReps);
+      return buf;
+    }
+
+    static std::string Ranges(const Analysis &a, const std::string &spec)
+    {
+      std::string out;
+      const char *p = spec.c_str();
+      char *end;
+      for (;;)
+      {
+        UInt64 offset = strtoull(p, &end, 10);
+        if (end == p)
+          break;
+        p = end;
+        UInt64 size = strtoull(p, &end, 10);
+        if (end == p)
+          throw "Bad range list";
+        p = end;
+        UInt64 last = std::min(offset + size, (UInt64)a.Costs.size());
+        double bits = 0;
+        for (UInt64 i = offset; i < last; i++)
+          bits += a.Costs[i];
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.4f %.6f\n", bits, a.MaxCost > 0 ? bits / a.MaxCost : 0);
+        out += buf;
+      }
+      if (*p)
+        throw "Bad range list";
+      return out;
+    }
+
+    // Returns false if the connection should be closed.
+    bool HandleRequest(Connection &conn, const std::string &line)
+    {
+      std::string reply;
+      try {
+        size_t sp1 = line.find(' ');
+        std::string command = line.substr(0, sp1);
+        if (command == "stats" && sp1 == std::string::npos) {
+          reply = Results.Stats();
+          return conn.Write("ok " + std::to_string(reply.size()) + "\n" + reply);
+        }
+        size_t sp2 = sp1 == std::string::npos ? sp1 : line.find(' ', sp1 + 1);
+        if (sp2 == std::string::npos)
+          throw "Bad request";
+        std::string kind = line.substr(sp1 + 1, sp2 - sp1 - 1);
+        std::string arg = line.substr(sp2 + 1);
+
+        bool known = command == "costs" || command == "summary" || command == "ranges";
+        UInt64 size = 0;
+        if (kind == "buffer") {
+          char *end;
+          size = strtoull(arg.c_str(), &end, 10);
+          if (*end || arg.empty() || (MaxInput != 0 && size > MaxInput)) {
+            conn.Write("error Bad buffer size\n");
+            return false;
+          }
+        } else if (kind != "file")
+          throw "Bad request";
+        // Checked before anything is read or decoded, but the payload of a
+        // buffer is still consumed so that the connection stays usable.
+        if (!known) {
+          if (kind == "buffer" && !conn.Skip(size))
+            return false;
+          throw "Unknown command";
+        }
+
+        std::string ranges;
+        if (command == "ranges" && !conn.ReadLine(ranges))
+          return false;
+
+        InputPtr input;
+        if (kind == "file")
+          input = ReadInputFile(arg, MaxInput);
+        else {
+          // The buffer can't be skipped once reading it fails, so any
+          // failure here closes the connection.
+          std::shared_ptr<std::vector<Byte> > data;
+          try {
+            data.reset(new std::vector<Byte>);
+            if (!conn.Read(*data, (size_t)size))
+              return false;
+          } catch (const std::exception &) {
+            conn.Write("error Out of memory\n");
+            return false;
+          }
+          input = data;
+        }
+
+        AnalysisPtr a = Results.Get(input);
+        if (!a->Error.empty())
+          return conn.Write("error " + a->Error + "\n");
+        if (command == "costs")
+          reply = Costs(*a);
+        else if (command == "summary")
+          reply = Summary(*a);
+        else
+          reply = Ranges(*a, ranges);
+      } catch (const char *e) {
+        return conn.Write(std::string("error ") + e + "\n");
+      } catch (const std::bad_alloc &) {
+        return conn.Write("error Out of memory\n");
+      } catch (const std::exception &e) {
+        return conn.Write(std::string("error ") + e.what() + "\n");
+      }
+      return conn.Write("ok " + std::to_string(reply.size()) + "\n") && conn.Write(reply);
+    }
+
+    void HandleConnection(int fd)
+    {
+      Connection conn(fd);
+      std::string line;
+      while (conn.ReadLine(line) && HandleRequest(conn, line))
+        ;
+    }
+
+  public:
+    // cacheLimit is the memory for cached results; decodeLimit (0 for none)
+    // limits the memory of each decode and the size of the inputs.
+    Server(unsigned numThreads, UInt64 cacheLimit, UInt64 decodeLimit):
+        Pool(numThreads), Results(Pool, cacheLimit, decodeLimit), MaxInput(decodeLimit) {}
+
+    // Serves until the process is killed. Replaces a stale socket file but
+    // refuses to start if another server answers on it or if path is not a
+    // socket.
+    void Run(const char *path)
+    {
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      if (strlen(path) >= sizeof(addr.sun_path))
+        throw "Socket path too long";
+      strcpy(addr.sun_path, path);
+
+      struct stat st;
+      if (lstat(path, &st) == 0)
+      {
+        if (!S_ISSOCK(st.st_mode))
+          throw "Socket path exists and is not a socket";
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe < 0)
+          throw "Can't create socket";
+        bool listening = connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(probe);
+        if (listening)
+          throw "A server is already listening on the socket";
+        unlink(path);
+      }
+
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0)
+        throw "Can't create socket";
+      if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0)
+      {
+        close(fd);
+        throw "Can't listen on socket";
+      }
+      for (;;)
+      {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          close(fd);
+          throw "Can't accept connection";
+        }
+        std::thread([this, client]() { HandleConnection(client); }).detach();
+      }
+    }
+  };
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+// Buffered writer for the numbers printed by --raw.
+//
+// Numbers are formatted with std::to_chars, which doesn't depend on the
+// locale, into a large block that is handed to stdout in one piece, instead
+// of going through an ostream and flushing after every line.
+
+#include <stdio.h>
+#include <charconv>
+#include <string>
+#include <vector>
+
+#define kRawWriterBufSize (1 << 20)
+// Longest number to_chars can produce for the precisions accepted.
+#define kRawWriterMaxNumber 32
+#define kRawMaxPrecision 17
+
+class CRawWriter
+{
+  std::vector<char> Buf;
+  size_t Used;
+  int Precision;
+  std::string *Out;
+
+public:
+  // precision is the number of significant digits as with printf("%g"); 6
+  // prints the same text as an ostream with default settings. 0 prints the
+  // shortest text that reads back as exactly the same double. Writes to out
+  // instead of stdout when given.
+  CRawWriter(int precision, std::string *out = NULL):
+      Buf(kRawWriterBufSize), Used(0), Precision(precision), Out(out) {}
+
+  void Number(double v)
+  {
+    if (Used + kRawWriterMaxNumber > Buf.size())
+      Flush();
+    char *first = Buf.data() + Used;
+    char *last = Buf.data() + Buf.size();
+    std::to_chars_result res = Precision == 0 ?
+        std::to_chars(first, last, v) :
+        std::to_chars(first, last, v, std::chars_format::general, Precision);
+    Used = res.ptr - Buf.data();
+  }
+
+  void Char(char c)
+  {
+    if (Used == Buf.size())
+      Flush();
+    Buf[Used++] = c;
+  }
+
+  void Flush()
+  {
+    if (Used == 0)
+      return;
+    if (Out)
+    {
+      Out->append(Buf.data(), Used);
+      Used = 0;
+      return;
+    }
+    bool failed = fwrite(Buf.data(), 1, Used, stdout) != Used || fflush(stdout) != 0;
+    Used = 0;
+    if (failed)
+      throw "Can't write output";
+  }
+};